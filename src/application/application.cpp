@@ -32,7 +32,8 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_max_tolerance,
     config.pathtracer_envmap,
     config.pathtracer_direct_hemisphere_sample,
-    config.pathtracer_filename
+    config.pathtracer_filename,
+    config.pathtracer_options
   );
   filename = config.pathtracer_filename;
 }
@@ -443,6 +444,9 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
             renderer->stop();
             renderer->start_raytracing();
             break;
+          case 'x': case 'X':
+            renderer->finish();
+            break;
           case 'd': case 'D':
             camera.dump_settings(filename + "_cam_settings.txt");
             break;
@@ -77,6 +77,8 @@ struct AppConfig {
   bool pathtracer_direct_hemisphere_sample;
 
   string pathtracer_filename;
+
+  RenderOptions pathtracer_options;
 };
 
 class Application : public Renderer {
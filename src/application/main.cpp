@@ -27,8 +27,20 @@ void usage(const char* binaryName) {
   printf("  -s  <INT>        Number of camera rays per pixel\n");
   printf("  -l  <INT>        Number of samples per area light\n");
   printf("  -t  <INT>        Number of render threads\n");
+  printf("  -P  <INT>        Samples per pixel added in each progressive pass (0: one pass)\n");
+  printf("  -g               Spend the samples of -s where the image is noisiest, not per pixel\n");
+  printf("  -T  <FLOAT>      Stop rendering after this many seconds (with -s as the limit)\n");
+  printf("  -E  <FLOAT>      Stop rendering once the mean relative pixel error is this low\n");
+  printf("  -A               Pin each render thread to one CPU (Linux only)\n");
   printf("  -m  <INT>        Maximum ray depth\n");
   printf("  -e  <PATH>       Path to environment map\n");
+  printf("  -b  <NAME>       BVH construction method (mid, sah, lbvh)\n");
+  printf("  -i  <NAME>       Integrator (recursive, wavefront, mis)\n");
+  printf("  -z  <INT>        Side of the render tiles in pixels (0: pick from image and threads)\n");
+  printf("  -o  <NAME>       Tile order (rows, spiral, hilbert, morton)\n");
+  printf("  -q  <NAME>       Sample sequence (random, sobol, halton)\n");
+  printf("  -L  <NAME>       Light selection for direct lighting (all, power, bvh)\n");
+  printf("  -M  <NAME>       Multiple importance sampling heuristic (balance, power)\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
   printf("  -h               Print this help message\n");
@@ -66,9 +78,9 @@ HDRImageBuffer* load_exr(const char* file_path) {
   float* channel_g = (float*) exr.images[1];
   float* channel_b = (float*) exr.images[0];
   for (size_t i = 0; i < exr.width * exr.height; i++) {
-    envmap->data[i] = Spectrum(channel_r[i], 
-                               channel_g[i], 
-                               channel_b[i]);
+    envmap->data[i] = HDRImageBuffer::Pixel(channel_r[i],
+                                            channel_g[i],
+                                            channel_b[i]);
   }
 
   return envmap;
@@ -81,7 +93,7 @@ int main( int argc, char** argv ) {
   bool write_to_file = false;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
   string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:a:p:")) != -1 ) {  // for each option...
+  while ( (opt = getopt(argc, argv, "s:l:t:AP:gT:E:m:e:b:i:z:o:q:L:M:h:H:f:r:c:a:p:")) != -1 ) {  // for each option...
     switch ( opt ) {
       case 'f':
           write_to_file = true;
@@ -108,12 +120,102 @@ int main( int argc, char** argv ) {
       case 't':
           config.pathtracer_num_threads = atoi(optarg);
           break;
+      case 'A':
+          config.pathtracer_options.pin_threads = true;
+          break;
+      case 'P':
+          config.pathtracer_options.samples_per_pass = atoi(optarg);
+          break;
+      case 'g':
+          config.pathtracer_options.adaptive_image = true;
+          break;
+      case 'T':
+          config.pathtracer_options.time_budget = atof(optarg);
+          break;
+      case 'E':
+          config.pathtracer_options.error_budget = atof(optarg);
+          break;
       case 'm':
           config.pathtracer_max_ray_depth = atoi(optarg);
           break;
       case 'e':
           config.pathtracer_envmap = load_exr(optarg);
           break;
+      case 'b':
+          if (string(optarg) == "mid") {
+            config.pathtracer_options.bvh_split_method = SceneObjects::BVH_SPLIT_MIDPOINT;
+          } else if (string(optarg) == "sah") {
+            config.pathtracer_options.bvh_split_method = SceneObjects::BVH_SPLIT_SAH;
+          } else if (string(optarg) == "lbvh") {
+            config.pathtracer_options.bvh_split_method = SceneObjects::BVH_SPLIT_LBVH;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'i':
+          if (string(optarg) == "recursive") {
+            config.pathtracer_options.integrator = INTEGRATOR_RECURSIVE;
+          } else if (string(optarg) == "wavefront") {
+            config.pathtracer_options.integrator = INTEGRATOR_WAVEFRONT;
+          } else if (string(optarg) == "mis") {
+            config.pathtracer_options.integrator = INTEGRATOR_MIS;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'z':
+          config.pathtracer_options.tile_size = atoi(optarg);
+          break;
+      case 'o':
+          if (string(optarg) == "rows") {
+            config.pathtracer_options.tile_order = TILE_ORDER_ROWS;
+          } else if (string(optarg) == "spiral") {
+            config.pathtracer_options.tile_order = TILE_ORDER_SPIRAL;
+          } else if (string(optarg) == "hilbert") {
+            config.pathtracer_options.tile_order = TILE_ORDER_HILBERT;
+          } else if (string(optarg) == "morton") {
+            config.pathtracer_options.tile_order = TILE_ORDER_MORTON;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'q':
+          if (string(optarg) == "random") {
+            config.pathtracer_options.sample_sequence = SEQUENCE_RANDOM;
+          } else if (string(optarg) == "sobol") {
+            config.pathtracer_options.sample_sequence = SEQUENCE_SOBOL;
+          } else if (string(optarg) == "halton") {
+            config.pathtracer_options.sample_sequence = SEQUENCE_HALTON;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'L':
+          if (string(optarg) == "all") {
+            config.pathtracer_options.light_selection = SceneObjects::LIGHT_SELECT_ALL;
+          } else if (string(optarg) == "power") {
+            config.pathtracer_options.light_selection = SceneObjects::LIGHT_SELECT_POWER;
+          } else if (string(optarg) == "bvh") {
+            config.pathtracer_options.light_selection = SceneObjects::LIGHT_SELECT_BVH;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'M':
+          if (string(optarg) == "balance") {
+            config.pathtracer_options.mis_heuristic = MIS_BALANCE;
+          } else if (string(optarg) == "power") {
+            config.pathtracer_options.mis_heuristic = MIS_POWER;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
       case 'c':
           cam_settings = string(optarg);
           break;
@@ -2,7 +2,6 @@
 
 #include "pathtracer/camera.h"
 #include "util/image.h"
-#include "util/work_queue.h"
 
 #include "application/renderer.h"
 
@@ -55,6 +54,12 @@ public:
      */
     virtual void stop() = 0;
 
+    /**
+     * Ends a render early and keeps the image so far: transitions from
+     * RENDERING to DONE.
+     */
+    virtual void finish() = 0;
+
     /**
      * If the pathtracer is in READY, delete all internal data, transition to INIT.
      */
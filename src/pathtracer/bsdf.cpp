@@ -58,7 +58,8 @@ Spectrum DiffuseBSDF::f(const Vector3D &wo, const Vector3D &wi) {
 /**
  * Evalutate diffuse lambertian BSDF.
  */
-Spectrum DiffuseBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
+Spectrum DiffuseBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf,
+                               SamplerState &rng) {
   // TODO (Part 3.1):
   // This function takes in only wo and provides pointers for wi and pdf,
   // which should be assigned by this function.
@@ -66,12 +67,19 @@ Spectrum DiffuseBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
   // at (wo, *wi).
   // You can use the `f` function. The reference solution only takes two lines.
 
-    *wi = sampler.get_sample(pdf);
+    *wi = sampler.get_sample(rng, pdf);
     return reflectance / PI;
     
 //  return Spectrum(1.0);
 }
 
+/**
+ * Evalutate the pdf of the cosine weighted samples of sample_f.
+ */
+double DiffuseBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return wi.z > 0 ? wi.z / PI : 0;
+}
+
 //===============================================================
 // Project 3-2 Code. Don't worry about these for project 3-1
 //===============================================================
@@ -87,10 +95,18 @@ Spectrum MirrorBSDF::f(const Vector3D &wo, const Vector3D &wi) {
 /**
  * Evalutate Mirror BSDF
  */
-Spectrum MirrorBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
+Spectrum MirrorBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf,
+                              SamplerState &rng) {
   return Spectrum();
 }
 
+/**
+ * Evalutate Mirror BSDF pdf
+ */
+double MirrorBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return 0;
+}
+
 /**
  * Evalutate Glossy BSDF
  */
@@ -101,10 +117,18 @@ Spectrum GlossyBSDF::f(const Vector3D &wo, const Vector3D &wi) {
 /**
  * Evalutate Glossy BSDF
  */
-Spectrum GlossyBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
+Spectrum GlossyBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf,
+                              SamplerState &rng) {
   return Spectrum();
 }
 
+/**
+ * Evalutate Glossy BSDF pdf
+ */
+double GlossyBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return 0;
+}
+
 /**
  * Evalutate Refraction BSDF
  */
@@ -116,10 +140,17 @@ Spectrum RefractionBSDF::f(const Vector3D &wo, const Vector3D &wi) {
  * Evalutate Refraction BSDF
  */
 Spectrum RefractionBSDF::sample_f(const Vector3D &wo, Vector3D *wi,
-                                  float *pdf) {
+                                  float *pdf, SamplerState &rng) {
   return Spectrum();
 }
 
+/**
+ * Evalutate Refraction BSDF pdf
+ */
+double RefractionBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return 0;
+}
+
 /**
  * Evalutate Glass BSDF
  */
@@ -130,10 +161,18 @@ Spectrum GlassBSDF::f(const Vector3D &wo, const Vector3D &wi) {
 /**
  * Evalutate Glass BSDF
  */
-Spectrum GlassBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
+Spectrum GlassBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf,
+                             SamplerState &rng) {
   return Spectrum();
 }
 
+/**
+ * Evalutate Glass BSDF pdf
+ */
+double GlassBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return 0;
+}
+
 /**
  * Compute the reflection vector according to incident vector
  */
@@ -154,10 +193,18 @@ Spectrum EmissionBSDF::f(const Vector3D &wo, const Vector3D &wi) {
 /**
  * Evalutate Emission BSDF (Light Source)
  */
-Spectrum EmissionBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf) {
+Spectrum EmissionBSDF::sample_f(const Vector3D &wo, Vector3D *wi, float *pdf,
+                                SamplerState &rng) {
   *pdf = 1.0 / PI;
-  *wi = sampler.get_sample(pdf);
+  *wi = sampler.get_sample(rng, pdf);
   return Spectrum();
 }
 
+/**
+ * Evalutate Emission BSDF pdf
+ */
+double EmissionBSDF::pdf(const Vector3D &wo, const Vector3D &wi) {
+  return wi.z > 0 ? wi.z / PI : 0;
+}
+
 } // namespace CGL
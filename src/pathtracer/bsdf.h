@@ -80,9 +80,21 @@ class BSDF {
    * \param wo outgoing light direction in local space of point of intersection
    * \param wi address to store incident light direction
    * \param pdf address to store the pdf of the sampled incident direction
+   * \param rng random number stream to draw from
    * \return reflectance in the output incident and given outgoing directions
    */
-  virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) = 0;
+  virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf,
+                             SamplerState& rng) = 0;
+
+  /**
+   * Evaluate the pdf with which sample_f samples wi given wo, both in local
+   * space at the point of intersection. Delta BSDFs return 0, since no
+   * direction but their own can be sampled.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return density of wi with respect to solid angle
+   */
+  virtual double pdf (const Vector3D& wo, const Vector3D& wi) = 0;
 
   /**
    * Get the emission value of the surface material. For non-emitting surfaces
@@ -128,7 +140,9 @@ class DiffuseBSDF : public BSDF {
   DiffuseBSDF(const Spectrum& a) : reflectance(a) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -158,7 +172,9 @@ class MirrorBSDF : public BSDF {
   MirrorBSDF(const Spectrum& reflectance) : reflectance(reflectance) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -180,7 +196,9 @@ class GlossyBSDF : public BSDF {
     : reflectance(reflectance), shininess(shininess) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -202,7 +220,9 @@ class RefractionBSDF : public BSDF {
     : transmittance(transmittance), roughness(roughness), ior(ior) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -226,7 +246,9 @@ class GlassBSDF : public BSDF {
     roughness(roughness), ior(ior) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -248,7 +270,9 @@ class EmissionBSDF : public BSDF {
   EmissionBSDF(const Spectrum& radiance) : radiance(radiance) { }
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                    SamplerState& rng);
+  double pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return radiance; }
   bool is_delta() const { return false; }
 
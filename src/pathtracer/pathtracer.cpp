@@ -1,5 +1,7 @@
 #include "pathtracer.h"
 
+#include <algorithm>
+
 #include "scene/light.h"
 #include "scene/sphere.h"
 #include "scene/triangle.h"
@@ -12,6 +14,10 @@ namespace CGL {
 PathTracer::PathTracer() {
   gridSampler = new UniformGridSampler2D();
   hemisphereSampler = new UniformHemisphereSampler3D();
+  sampleSequence = SEQUENCE_RANDOM;
+  lightSampler = NULL;
+  multiple_importance_sample = false;
+  misHeuristic = MIS_POWER;
 
   tm_gamma = 2.2f;
   tm_level = 1.0f;
@@ -27,16 +33,19 @@ PathTracer::~PathTracer() {
 void PathTracer::set_frame_size(size_t width, size_t height) {
   sampleBuffer.resize(width, height);
   sampleCountBuffer.resize(width * height);
+  pixelSamples.assign(width * height, PixelSamples(ns_aa));
 }
 
 void PathTracer::clear() {
   bvh = NULL;
+  lightSampler = NULL;
   scene = NULL;
   camera = NULL;
   sampleBuffer.clear();
   sampleCountBuffer.clear();
   sampleBuffer.resize(0, 0);
   sampleCountBuffer.resize(0, 0);
+  pixelSamples.clear();
 }
 
 void PathTracer::write_to_framebuffer(ImageBuffer &framebuffer, size_t x0,
@@ -46,7 +55,8 @@ void PathTracer::write_to_framebuffer(ImageBuffer &framebuffer, size_t x0,
 
 Spectrum
 PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
-                                                const Intersection &isect) {
+                                                const Intersection &isect,
+                                                SamplerState &rng) {
   // Estimate the lighting from this intersection coming directly from a light.
   // For this function, sample uniformly in a hemisphere.
 
@@ -72,7 +82,7 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
   // UPDATE `est_radiance_global_illumination` to return direct lighting instead of normal shading
     
     for (int i = 0; i < num_samples; i++) {
-        Vector3D sample = hemisphereSampler->get_sample();
+        Vector3D sample = hemisphereSampler->get_sample(rng);
         Vector3D d_sample = o2w * sample;
         Ray r_sample = Ray(hit_p + (EPS_D * d_sample), d_sample);
         Intersection intersection;
@@ -81,6 +91,9 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
             Spectrum emission = intersection.bsdf->get_emission();
             Spectrum f = isect.bsdf->f(w_out, sample);
             L_out += f * emission * cos_theta(sample) / (0.5 / PI);
+        } else if (envLight) {
+            Spectrum f = isect.bsdf->f(w_out, sample);
+            L_out += f * envLight->sample_dir(r_sample) * cos_theta(sample) / (0.5 / PI);
         }
     }
     L_out = L_out / num_samples;
@@ -92,7 +105,8 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
 
 Spectrum
 PathTracer::estimate_direct_lighting_importance(const Ray &r,
-                                                const Intersection &isect) {
+                                                const Intersection &isect,
+                                                SamplerState &rng) {
   // Estimate the lighting from this intersection coming directly from a light.
   // To implement importance sampling, sample only from lights, not uniformly in
   // a hemisphere.
@@ -109,6 +123,31 @@ PathTracer::estimate_direct_lighting_importance(const Ray &r,
   const Vector3D &w_out = w2o * (-r.d);
   Spectrum L_out;
 
+  // With a light sampler, take ns_area_light samples in all, each of a light
+  // picked for this point, instead of that many of every light.
+  if (lightSampler) {
+    for (size_t i = 0; i < ns_area_light; i++) {
+      double pmf;
+      const SceneLight* light = lightSampler->sample(hit_p, isect.n, rng, &pmf);
+      if (!light) continue;
+
+      Vector3D wi;
+      float distance;
+      float pdf;
+      Spectrum l_sample = light->sample_L(hit_p, &wi, &distance, &pdf, rng);
+      Vector3D wi_w2o = w2o * wi;
+      if (wi_w2o.z < 0) continue;
+
+      Ray r_sample = Ray(hit_p + (EPS_D * wi), wi);
+      r_sample.max_t = distance * (1 - kShadowEpsilon);
+      if (!bvh->has_intersection(r_sample)) {
+        Spectrum f = isect.bsdf->f(w_out, wi_w2o);
+        L_out += l_sample * f * cos_theta(wi_w2o) / (pdf * pmf);
+      }
+    }
+    return L_out / ns_area_light;
+  }
+
     for (auto l = scene->lights.begin(); l != scene->lights.end(); l++) {
         int num_samples;
         if ((*l)->is_delta_light()) {
@@ -121,15 +160,13 @@ PathTracer::estimate_direct_lighting_importance(const Ray &r,
             Vector3D wi;
             float distance;
             float pdf;
-            Spectrum l_sample = (*l)->sample_L(hit_p, &wi, &distance, &pdf);
+            Spectrum l_sample = (*l)->sample_L(hit_p, &wi, &distance, &pdf, rng);
             Vector3D wi_w2o = w2o * wi;
             
             if (wi_w2o.z >= 0) {
                 Ray r_sample = Ray(hit_p + (EPS_D * wi), wi);
-                r_sample.max_t = distance;
-                Intersection intersection;
-                bool intersect = bvh->intersect(r_sample, &intersection);
-                if (intersect == false) {
+                r_sample.max_t = distance * (1 - kShadowEpsilon);
+                if (!bvh->has_intersection(r_sample)) {
                     Spectrum f = isect.bsdf->f(w_out, wi_w2o);
                     L_out += l_sample * f * cos_theta(wi_w2o) / pdf;
                 }
@@ -151,55 +188,188 @@ Spectrum PathTracer::zero_bounce_radiance(const Ray &r,
 }
 
 Spectrum PathTracer::one_bounce_radiance(const Ray &r,
-                                         const Intersection &isect) {
+                                         const Intersection &isect,
+                                         SamplerState &rng) {
   // TODO: Part 3, Task 3
   // Returns either the direct illumination by hemisphere or importance sampling
   // depending on `direct_hemisphere_sample`
     
     if (direct_hemisphere_sample == true) {
-        return estimate_direct_lighting_hemisphere(r, isect);
+        return estimate_direct_lighting_hemisphere(r, isect, rng);
     } else {
-        return estimate_direct_lighting_importance(r, isect);
+        return estimate_direct_lighting_importance(r, isect, rng);
     }
 
 //  return Spectrum(1.0);
 }
 
 Spectrum PathTracer::at_least_one_bounce_radiance(const Ray &r,
-                                                  const Intersection &isect) {
-  Matrix3x3 o2w;
-  make_coord_space(o2w, isect.n);
-  Matrix3x3 w2o = o2w.T();
+                                                  const Intersection &isect,
+                                                  SamplerState &rng) {
+  if (r.depth == 0) return zero_bounce_radiance(r, isect);
 
-  Vector3D hit_p = r.o + r.d * isect.t;
-  Vector3D w_out = w2o * (-r.d);
-    
+  // Direct lighting at every vertex; a BSDF sample leads from each vertex
+  // but the last to the next.
+  Spectrum L_out;
+  PathState path(r.depth);
+  Ray ray = r;
+  Intersection hit = isect;
+  while (true) {
+    L_out += path.throughput * one_bounce_radiance(ray, hit, rng);
+    if (path.depth <= 1) break;
+
+    Matrix3x3 o2w;
+    make_coord_space(o2w, hit.n);
+    Vector3D hit_p = ray.o + ray.d * hit.t;
+    Vector3D w_out = o2w.T() * (-ray.d);
+
+    Vector3D wi;
+    float pdf;
+    Spectrum f = hit.bsdf->sample_f(w_out, &wi, &pdf, rng);
+    if (f.illum() <= 0 || pdf <= 0) break;
+    path.bounce(f, pdf, wi, hit.bsdf->is_delta());
+    if (!path.survive_roulette(rng)) break;
+
+    Vector3D direction = o2w * wi;
+    ray = Ray(hit_p + (EPS_D * direction), direction);
+    ray.depth = path.depth;
+    hit = Intersection();
+    if (!bvh->intersect(ray, &hit)) break;
+  }
+  return L_out;
+}
 
-    Spectrum L_out = one_bounce_radiance(r, isect);
-    if (r.depth == 0) {return zero_bounce_radiance(r, isect);}
-    if (r.depth <= 1) {
-        return one_bounce_radiance(r, isect);
-    } else {
-//        if (r.depth == max_ray_depth) {L_out = Spectrum(0, 0, 0);}
-        double p = 0.65;
-        Vector3D wi;
-        float pdf;
-        Spectrum l = isect.bsdf->sample_f(w_out, &wi, &pdf);
-        if (coin_flip(p)) {
-            Vector3D direction = o2w * wi;
-            Ray ray = Ray(hit_p + (EPS_D * direction), direction);
-            ray.depth = r.depth - 1;
-            Intersection intersection;
-            bool intersect = bvh->intersect(ray, &intersection);
-            if (intersect) {
-                    L_out += (at_least_one_bounce_radiance(ray, intersection)) * l * cos_theta(wi) / pdf / p;
-            }
-        }
+Spectrum PathTracer::at_least_one_bounce_radiance_mis(const Ray &r,
+                                                      const Intersection &isect,
+                                                      SamplerState &rng) {
+  Spectrum L_out;
+  PathState path(r.depth);
+  Ray ray = r;
+  Intersection hit = isect;
+
+  while (path.depth > 0) {
+    Matrix3x3 o2w;
+    make_coord_space(o2w, hit.n);
+    Matrix3x3 w2o = o2w.T();
+
+    Vector3D hit_p = ray.o + ray.d * hit.t;
+    Vector3D w_out = w2o * (-ray.d);
+    BSDF* bsdf = hit.bsdf;
+
+    if (!bsdf->is_delta()) {
+      L_out += path.throughput * estimate_direct_lighting_mis(hit_p, hit, w2o, w_out, rng);
     }
-    return L_out;
+
+    // The BSDF sample both finds light, weighed against the light samples
+    // above, and continues the path.
+    Vector3D wi;
+    float pdf;
+    Spectrum f = bsdf->sample_f(w_out, &wi, &pdf, rng);
+    if (f.illum() <= 0 || pdf <= 0) break;
+    path.bounce(f, pdf, wi, bsdf->is_delta());
+
+    Vector3D direction = o2w * wi;
+    Ray next = Ray(hit_p + (EPS_D * direction), direction);
+    next.depth = path.depth;
+    Intersection next_hit;
+    bool found = bvh->intersect(next, &next_hit);
+    L_out += path.throughput * estimate_light_emission_mis(
+        hit_p, hit.n, next, found ? next_hit.t : INF_D, path.pdf);
+
+    if (!found || path.depth == 0 || !path.survive_roulette(rng)) break;
+    ray = next;
+    hit = next_hit;
+  }
+  return L_out;
+}
+
+Spectrum PathTracer::estimate_direct_lighting_mis(const Vector3D &hit_p,
+                                                  const Intersection &isect,
+                                                  const Matrix3x3 &w2o,
+                                                  const Vector3D &w_out,
+                                                  SamplerState &rng) {
+  Spectrum L_out;
+  if (lightSampler) {
+    for (size_t i = 0; i < ns_area_light; i++) {
+      double pmf;
+      const SceneLight* light = lightSampler->sample(hit_p, isect.n, rng, &pmf);
+      if (!light) continue;
+      L_out += sample_light_mis(light, pmf, ns_area_light, hit_p, isect, w2o,
+                                w_out, rng);
+    }
+    return L_out / ns_area_light;
+  }
+
+  const std::vector<SceneLight*>& lights = scene->lights;
+  for (size_t j = 0; j < lights.size(); j++) {
+    size_t num_samples = lights[j]->is_delta_light() ? 1 : ns_area_light;
+    Spectrum L_light;
+    for (size_t i = 0; i < num_samples; i++) {
+      L_light += sample_light_mis(lights[j], 1, num_samples, hit_p, isect, w2o,
+                                  w_out, rng);
+    }
+    L_out += L_light / num_samples;
+  }
+  return L_out;
 }
 
-Spectrum PathTracer::est_radiance_global_illumination(const Ray &r) {
+Spectrum PathTracer::sample_light_mis(const SceneLight *light, double pmf,
+                                      size_t num_samples,
+                                      const Vector3D &hit_p,
+                                      const Intersection &isect,
+                                      const Matrix3x3 &w2o,
+                                      const Vector3D &w_out,
+                                      SamplerState &rng) {
+  Vector3D wi;
+  float distance;
+  float pdf;
+  Spectrum l_sample = light->sample_L(hit_p, &wi, &distance, &pdf, rng);
+  Vector3D wi_w2o = w2o * wi;
+  if (wi_w2o.z <= 0 || pdf <= 0 || l_sample.illum() <= 0) return Spectrum();
+
+  Ray r_sample = Ray(hit_p + (EPS_D * wi), wi);
+  r_sample.max_t = distance * (1 - kShadowEpsilon);
+  if (bvh->has_intersection(r_sample)) return Spectrum();
+
+  // Delta lights are out of reach of BSDF samples.
+  double weight = 1;
+  if (!light->is_delta_light()) {
+    weight = mis_weight(misHeuristic, num_samples, pmf * pdf, 1,
+                        isect.bsdf->pdf(w_out, wi_w2o));
+  }
+  Spectrum f = isect.bsdf->f(w_out, wi_w2o);
+  return l_sample * f * (cos_theta(wi_w2o) * weight / (pmf * pdf));
+}
+
+Spectrum PathTracer::estimate_light_emission_mis(const Vector3D &hit_p,
+                                                 const Vector3D &n,
+                                                 const Ray &r, double max_t,
+                                                 double bsdf_pdf) {
+  Spectrum L_out;
+  const std::vector<SceneLight*>& lights = scene->lights;
+  for (size_t j = 0; j < lights.size(); j++) {
+    float distance;
+    float pdf;
+    Spectrum l = lights[j]->eval_L(r.o, r.d, &distance, &pdf);
+    if (pdf <= 0 || distance * (1 - kShadowEpsilon) > max_t) continue;
+
+    double weight = 1;
+    if (bsdf_pdf > 0) {
+      double pmf = light_pmf(hit_p, n, lights[j]);
+      weight = mis_weight(misHeuristic, 1, bsdf_pdf, ns_area_light, pmf * pdf);
+    }
+    L_out += l * weight;
+  }
+  return L_out;
+}
+
+double PathTracer::light_pmf(const Vector3D &p, const Vector3D &n,
+                             const SceneLight *light) const {
+  return lightSampler ? lightSampler->pmf(p, n, light) : 1;
+}
+
+Spectrum PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      SamplerState &rng) {
   Intersection isect;
   Spectrum L_out;
 
@@ -208,7 +378,7 @@ Spectrum PathTracer::est_radiance_global_illumination(const Ray &r) {
   // This changes if you implement hemispherical lighting for extra credit.
 
   if (!bvh->intersect(r, &isect))
-    return L_out;
+    return envLight ? envLight->sample_dir(r) : L_out;
 
   // The following line of code returns a debug color depending
   // on whether ray intersection with triangles or spheres has
@@ -222,10 +392,28 @@ Spectrum PathTracer::est_radiance_global_illumination(const Ray &r) {
   // TODO (Part 4): Accumulate the "direct" and "indirect"
   // parts of global illumination into L_out rather than just direct
 
-  return zero_bounce_radiance(r, isect) + at_least_one_bounce_radiance(r, isect);
+  return est_radiance_global_illumination(r, isect, rng);
+}
+
+Spectrum PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      const Intersection &isect,
+                                                      SamplerState &rng) {
+  if (multiple_importance_sample) {
+    return zero_bounce_radiance(r, isect) +
+           at_least_one_bounce_radiance_mis(r, isect, rng);
+  }
+  return zero_bounce_radiance(r, isect) + at_least_one_bounce_radiance(r, isect, rng);
 }
 
 void PathTracer::raytrace_pixel(size_t x, size_t y) {
+  TileBuffer tile;
+  load_tile(tile, x, y, x + 1, y + 1);
+  raytrace_pixels(tile, x, y, x + 1, y + 1, ns_aa);
+  commit_tile(tile);
+}
+
+void PathTracer::raytrace_pixels(TileBuffer& tile, size_t x0, size_t y0,
+                                 size_t x1, size_t y1, size_t num_samples) {
 
   // TODO (Part 1.1):
   // Make a loop that generates num_samples camera rays and traces them
@@ -236,39 +424,113 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
   // Modify your implementation to include adaptive sampling.
   // Use the command line parameters "samplesPerBatch" and "maxTolerance"
 
-  int num_samples = ns_aa;          // total samples to evaluate
-  Vector2D origin = Vector2D(x, y); // bottom left corner of the pixel
-
-    Spectrum s = Spectrum();
-    float s1 = 0;
-    float s2 = 0;
-    int n = 0;
-    for (n = 0; n < num_samples; n++) {
-        Vector2D sample = gridSampler->get_sample();
-        double x_normal = (sample.x + x) / sampleBuffer.w;
-        double y_normal = (sample.y + y) / sampleBuffer.h;
-        Ray r = camera->generate_ray(x_normal, y_normal);
-        r.depth = max_ray_depth;
-        Spectrum s0 = est_radiance_global_illumination(r);
-        float illm = s0.illum();
-        s1 += illm;
-        s2 += illm * illm;
-        s = s + s0;
-        if (n % samplesPerBatch == 0 && n > 0) {
-            float mean = s1 / float(n);
-            float variance = sqrt((1.0 / float(n - 1.0)) * (s2 - (s1 * s1) / float(n)));
-            float i = 1.96 * variance / float(sqrt(n));
-            if (i <= maxTolerance * mean) {
-                break;
+  // The next sample of every pixel in the block is traced as one ray packet;
+  // pixels drop out of the packet once adaptive sampling considers them
+  // converged. Each sample draws from its own random stream, seeded by pixel
+  // and sample index, so the image depends neither on the thread count nor
+  // on how the samples of a pixel are split into passes.
+  size_t w = x1 - x0;
+  size_t num_pixels = w * (y1 - y0);
+
+    std::vector<Ray> rays(num_pixels, Ray(Vector3D(), Vector3D(0, 0, 1)));
+    Intersection isects[SceneObjects::kRayPacketSize];
+    SamplerState rngs[SceneObjects::kRayPacketSize];
+    PixelSamples* pixels[SceneObjects::kRayPacketSize];
+
+    uint32_t active = 0;
+    for (size_t k = 0; k < num_pixels; k++) {
+        pixels[k] = &tile.at(x0 + k % w, y0 + k / w);
+        if (pixels[k]->active()) active |= 1u << k;
+    }
+
+    for (size_t i = 0; i < num_samples && active; i++) {
+        for (size_t k = 0; k < num_pixels; k++) {
+            if (!(active & (1u << k))) continue;
+            size_t x = x0 + k % w;
+            size_t y = y0 + k / w;
+            rngs[k] = SamplerState(x + y * sampleBuffer.w, pixels[k]->taken,
+                                   sampleSequence);
+            Vector2D sample = gridSampler->get_sample(rngs[k]);
+            double x_normal = (sample.x + x) / sampleBuffer.w;
+            double y_normal = (sample.y + y) / sampleBuffer.h;
+            rays[k] = camera->generate_ray(x_normal, y_normal);
+            rays[k].depth = max_ray_depth;
+            isects[k] = Intersection();
+        }
+
+        uint32_t hits = bvh->intersect_packet(&rays[0], isects, active);
+
+        for (size_t k = 0; k < num_pixels; k++) {
+            if (!(active & (1u << k))) continue;
+            Spectrum s0;
+            if (hits & (1u << k)) {
+                s0 = est_radiance_global_illumination(rays[k], isects[k], rngs[k]);
+            } else if (envLight) {
+                s0 = envLight->sample_dir(rays[k]);
             }
+            pixels[k]->add(s0, samplesPerBatch, maxTolerance);
+            if (!pixels[k]->active()) active &= ~(1u << k);
         }
     }
-    sampleCountBuffer[x + y * sampleBuffer.w] = n;
-    s = s / (double)n;
-    sampleBuffer.update_pixel(s, x, y);
     
 //  sampleBuffer.update_pixel(Spectrum(0.2, 1.0, 0.8), x, y);
 //  sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
 }
 
+void PathTracer::load_tile(TileBuffer& tile, size_t x0, size_t y0,
+                           size_t x1, size_t y1) const {
+  tile.x0 = x0; tile.y0 = y0;
+  tile.x1 = x1; tile.y1 = y1;
+  tile.pixels.resize((x1 - x0) * (y1 - y0));
+  for (size_t y = y0; y < y1; y++) {
+    std::copy(&pixelSamples[x0 + y * sampleBuffer.w],
+              &pixelSamples[x1 + y * sampleBuffer.w], &tile.at(x0, y));
+  }
+}
+
+void PathTracer::commit_tile(const TileBuffer& tile) {
+  size_t w = tile.x1 - tile.x0;
+  for (size_t y = tile.y0; y < tile.y1; y++) {
+    for (size_t x = tile.x0; x < tile.x1; x++) {
+      const PixelSamples& pixel = tile.pixels[(x - tile.x0) + (y - tile.y0) * w];
+      size_t p = x + y * sampleBuffer.w;
+      pixelSamples[p] = pixel;
+      if (pixel.taken == 0) continue;
+      sampleCountBuffer[p] = pixel.taken;
+      sampleBuffer.update_pixel(pixel.value(), x, y);
+    }
+  }
+}
+
+bool PathTracer::accumulate_sample(size_t x, size_t y, const Spectrum& s) {
+  size_t p = x + y * sampleBuffer.w;
+  PixelSamples& pixel = pixelSamples[p];
+  pixel.add(s, samplesPerBatch, maxTolerance);
+  sampleCountBuffer[p] = pixel.taken;
+  sampleBuffer.update_pixel(pixel.value(), x, y);
+  return pixel.active();
+}
+
+void PixelSamples::add(const Spectrum& s, size_t samples_per_batch,
+                       float max_tolerance) {
+  int n = taken++;  // index of this sample
+
+  float illm = s.illum();
+  illum_sum += illm;
+  illum_sq_sum += illm * illm;
+  sum += s;
+
+  if (n % samples_per_batch == 0 && n > 0 && error() <= max_tolerance) {
+    converged = true;
+  }
+}
+
+float PixelSamples::error() const {
+  if (taken < 2 || illum_sum <= 0) return 0;
+  float mean = illum_sum / float(taken);
+  float variance = std::max(0.0f, (illum_sq_sum - (illum_sum * illum_sum) / float(taken)) /
+                                  float(taken - 1));
+  return 1.96 * sqrt(variance / taken) / mean;
+}
+
 } // namespace CGL
@@ -3,11 +3,15 @@
 
 #include "CGL/timer.h"
 
+#include <algorithm>
+
 #include "scene/bvh.h"
+#include "scene/light_sampler.h"
 #include "pathtracer/sampler.h"
 #include "pathtracer/intersection.h"
 
 #include "application/renderer.h"
+#include "util/aligned_allocator.h"
 
 #include "scene/scene.h"
 using CGL::SceneObjects::Scene;
@@ -20,6 +24,165 @@ using CGL::SceneObjects::BVHAccel;
 
 namespace CGL {
 
+    /**
+     * Integrator used to render a frame.
+     */
+    enum PathTracerIntegrator {
+        INTEGRATOR_RECURSIVE,  ///< depth-first, one camera sample at a time
+        INTEGRATOR_WAVEFRONT,  ///< breadth-first, see WavefrontIntegrator
+        INTEGRATOR_MIS         ///< depth-first, see at_least_one_bounce_radiance_mis
+    };
+
+    /**
+     * How multiple importance sampling weighs a sample against the other
+     * strategy that could have taken it (Veach, "Robust Monte Carlo Methods
+     * for Light Transport Simulation", 1997, chapter 9).
+     */
+    enum MISHeuristic {
+        MIS_BALANCE,  ///< in proportion to the density of each strategy
+        MIS_POWER     ///< in proportion to the squared density
+    };
+
+    /**
+     * Weight of a sample of a strategy taken nf times with density f_pdf,
+     * against a strategy taken ng times with density g_pdf.
+     */
+    inline double mis_weight(MISHeuristic heuristic, double nf, double f_pdf,
+                             double ng, double g_pdf) {
+        double f = nf * f_pdf;
+        double g = ng * g_pdf;
+        if (heuristic == MIS_POWER) {
+            f *= f;
+            g *= g;
+        }
+        return f / (f + g);
+    }
+
+    /**
+     * Bounces every path takes, up to the maximum ray depth, before Russian
+     * roulette may end it.
+     */
+    static const size_t kRouletteMinBounces = 3;
+
+    /**
+     * Probability with which a path of the given throughput continues after
+     * its bounce number bounces: 1 for the first kRouletteMinBounces, then
+     * the largest channel of the throughput, up to 1, so that paths that
+     * carry little light end early.
+     */
+    inline double continue_probability(const Spectrum& throughput,
+                                       size_t bounces) {
+        if (bounces < kRouletteMinBounces) return 1;
+        return std::min(1.0, std::max(throughput.r,
+                                      std::max(throughput.g, throughput.b)));
+    }
+
+    /**
+     * State of a path traced by the bounce loops of PathTracer, between the
+     * vertices it finds.
+     */
+    struct PathState {
+        Spectrum throughput;  ///< weight of the light found at the next vertex
+        size_t depth;         ///< bounces left, as Ray::depth of its ray
+        size_t bounces;       ///< bounces taken
+        double pdf;           ///< pdf of the last BSDF sample, 0 after a delta BSDF
+
+        PathState(size_t depth = 0)
+            : throughput(1, 1, 1), depth(depth), bounces(0), pdf(0) {}
+
+        /**
+         * Takes a bounce off a BSDF sample of value f and density pdf in
+         * direction wi, in the local space of the vertex; delta tells if the
+         * BSDF is a delta distribution.
+         */
+        void bounce(const Spectrum& f, double pdf, const Vector3D& wi,
+                    bool delta) {
+            throughput = throughput * f * (fabs(wi.z) / pdf);
+            this->pdf = delta ? 0 : pdf;
+            depth--;
+            bounces++;
+        }
+
+        /**
+         * Russian roulette after a bounce: ends the path with probability
+         * 1 - continue_probability, and divides the throughput of a path
+         * that goes on by it to keep it unbiased.
+         * \return whether the path goes on
+         */
+        bool survive_roulette(SamplerState& rng) {
+            double q = continue_probability(throughput, bounces);
+            if (q >= 1) return true;
+            if (!coin_flip(rng, q)) return false;
+            throughput = throughput / q;
+            return true;
+        }
+    };
+
+    /**
+     * Fraction of the distance to a light sample its shadow ray stops short
+     * by, so that emissive geometry lying on the light does not shadow it.
+     */
+    static const double kShadowEpsilon = 1e-4;
+
+    /**
+     * Running sums of the samples of one pixel, kept across passes, and the
+     * adaptive sampling state derived from them.
+     */
+    struct PixelSamples {
+        Spectrum sum;        ///< sum of the sample radiances
+        float illum_sum;     ///< sum of sample illuminances
+        float illum_sq_sum;  ///< sum of squared sample illuminances
+        int taken;           ///< samples traced
+        int limit;           ///< samples the pixel may take
+        bool converged;      ///< passed the adaptive sampling test
+
+        PixelSamples(int limit = 0)
+            : illum_sum(0), illum_sq_sum(0), taken(0), limit(limit),
+              converged(false) {}
+
+        /**
+         * Whether the pixel takes more samples.
+         */
+        bool active() const {
+            return !converged && taken < limit;
+        }
+
+        /**
+         * Adds the radiance s of the next sample and runs the adaptive
+         * sampling test every samples_per_batch samples.
+         */
+        void add(const Spectrum& s, size_t samples_per_batch, float max_tolerance);
+
+        /**
+         * Relative half width of the 95% confidence interval of the mean
+         * illuminance, the quantity the adaptive sampling test compares to
+         * maxTolerance; 0 with fewer than two samples or no light.
+         */
+        float error() const;
+
+        /**
+         * Pixel value, the average of the samples taken.
+         */
+        Spectrum value() const {
+            return sum / (double)taken;
+        }
+    };
+
+    /**
+     * Private copy of the PixelSamples of the rectangle [x0, x1) x [y0, y1)
+     * of the frame. A worker thread loads a tile into its own buffer, traces
+     * into it and commits it back in one go, so threads working on
+     * neighbouring tiles do not write to shared cache lines.
+     */
+    struct TileBuffer {
+        size_t x0, y0, x1, y1;
+        std::vector<PixelSamples, AlignedAllocator<PixelSamples> > pixels;
+
+        PixelSamples& at(size_t x, size_t y) {
+            return pixels[(x - x0) + (y - y0) * (x1 - x0)];
+        }
+    };
+
     class PathTracer {
     public:
         PathTracer();
@@ -43,15 +206,55 @@ namespace CGL {
         void clear();
 
         /**
-         * Trace an ray in the scene.
+         * Trace an ray in the scene. Random decisions draw from rng, the
+         * stream of the pixel sample the ray belongs to.
          */
-        Spectrum estimate_direct_lighting_hemisphere(const Ray& r, const SceneObjects::Intersection& isect);
-        Spectrum estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect);
+        Spectrum estimate_direct_lighting_hemisphere(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
+        Spectrum estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
 
-        Spectrum est_radiance_global_illumination(const Ray& r);
+        Spectrum est_radiance_global_illumination(const Ray& r, SamplerState& rng);
+        Spectrum est_radiance_global_illumination(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
         Spectrum zero_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
-        Spectrum one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
-        Spectrum at_least_one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
+        Spectrum one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
+        Spectrum at_least_one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
+
+        /**
+         * Radiance along r after at least one bounce off isect, traced as a
+         * path that samples both the lights and the BSDF at each vertex and
+         * weighs the two with multiple importance sampling. Both strategies
+         * look for the scene lights, so emissive surfaces only show where
+         * the camera sees them, as with light sampling alone.
+         */
+        Spectrum at_least_one_bounce_radiance_mis(const Ray& r, const SceneObjects::Intersection& isect, SamplerState& rng);
+
+        /**
+         * Light sample part of at_least_one_bounce_radiance_mis at hit_p:
+         * ns_area_light samples of lights picked by lightSampler, or as many
+         * of every light without one, as estimate_direct_lighting_importance
+         * takes.
+         */
+        Spectrum estimate_direct_lighting_mis(const Vector3D& hit_p, const SceneObjects::Intersection& isect, const Matrix3x3& w2o, const Vector3D& w_out, SamplerState& rng);
+
+        /**
+         * One weighted sample of light, picked with probability pmf, out of
+         * num_samples that estimate_direct_lighting_mis takes of it.
+         */
+        Spectrum sample_light_mis(const SceneObjects::SceneLight* light, double pmf, size_t num_samples, const Vector3D& hit_p, const SceneObjects::Intersection& isect, const Matrix3x3& w2o, const Vector3D& w_out, SamplerState& rng);
+
+        /**
+         * BSDF sample part of at_least_one_bounce_radiance_mis: radiance of
+         * the lights along r, which left hit_p with normal n and first hits
+         * the scene at max_t, for a BSDF sample of density bsdf_pdf, 0 if
+         * the BSDF is a delta distribution.
+         */
+        Spectrum estimate_light_emission_mis(const Vector3D& hit_p, const Vector3D& n, const Ray& r, double max_t, double bsdf_pdf);
+
+        /**
+         * Probability with which estimate_direct_lighting_mis picks light
+         * at point p with normal n; 1 without a light sampler, which takes
+         * samples of every light.
+         */
+        double light_pmf(const Vector3D& p, const Vector3D& n, const SceneObjects::SceneLight* light) const;
         
         Spectrum debug_shading(const Vector3D& d) {
             return Vector3D(abs(d.r), abs(d.g), .0).unit();
@@ -66,6 +269,42 @@ namespace CGL {
          */
         void raytrace_pixel(size_t x, size_t y);
 
+        /**
+         * Trace up to num_samples more camera rays through each pixel of
+         * [x0, x1) x [y0, y1), at most kRayPacketSize pixels inside tile, as
+         * ray packets. Samples add to the running sums of the pixels in tile,
+         * so a pixel can be refined over several calls; pixels that have
+         * converged or reached their sample limit are skipped.
+         */
+        void raytrace_pixels(TileBuffer& tile, size_t x0, size_t y0,
+                             size_t x1, size_t y1, size_t num_samples);
+
+        /**
+         * Copies the PixelSamples of [x0, x1) x [y0, y1) into tile.
+         */
+        void load_tile(TileBuffer& tile, size_t x0, size_t y0,
+                       size_t x1, size_t y1) const;
+
+        /**
+         * Copies tile back into pixelSamples and updates its pixels in the
+         * sample buffer.
+         */
+        void commit_tile(const TileBuffer& tile);
+
+        /**
+         * Adds the radiance s of the next sample of pixel (x, y) straight to
+         * pixelSamples and updates the pixel in the sample buffer.
+         * \return whether the pixel takes more samples
+         */
+        bool accumulate_sample(size_t x, size_t y, const Spectrum& s);
+
+        /**
+         * Whether pixel (x, y) takes more samples.
+         */
+        bool pixel_active(size_t x, size_t y) const {
+            return pixelSamples[x + y * sampleBuffer.w].active();
+        }
+
         // Integrator sampling settings //
 
         size_t max_ray_depth; ///< maximum allowed ray depth (applies to all rays)
@@ -77,12 +316,16 @@ namespace CGL {
 
         size_t samplesPerBatch;
         float maxTolerance;
+        SampleSequence sampleSequence;  ///< sequence the pixel samples draw from
         bool direct_hemisphere_sample; ///< true if sampling uniformly from hemisphere for direct lighting. Otherwise, light sample
+        bool multiple_importance_sample; ///< true to combine light and BSDF samples, see at_least_one_bounce_radiance_mis
+        MISHeuristic misHeuristic;     ///< weights of multiple importance sampling
 
         // Components //
 
         BVHAccel* bvh;                 ///< BVH accelerator aggregate
         EnvironmentLight* envLight;    ///< environment map
+        SceneObjects::LightSampler* lightSampler;  ///< picks the lights to sample, NULL to sample all
         Sampler2D* gridSampler;        ///< samples unit grid
         Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
         HDRImageBuffer sampleBuffer;   ///< sample buffer
@@ -90,6 +333,8 @@ namespace CGL {
 
         std::vector<int> sampleCountBuffer;   ///< sample count buffer
 
+        std::vector<PixelSamples> pixelSamples;  ///< running sums of each pixel, limited to ns_aa samples by default
+
         Scene* scene;         ///< current scene
         Camera* camera;       ///< current camera
 
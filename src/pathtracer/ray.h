@@ -76,6 +76,30 @@ struct Ray {
   }
 };
 
+/**
+ * Single precision copy of a ray, used by the BVH traversal kernels.
+ * Only the origin and direction are converted. The segment [min_t, max_t]
+ * stays on the source Ray, which primitives keep shrinking as they are hit.
+ */
+struct FloatRay {
+
+  FloatRay() { }
+
+  explicit FloatRay(const Ray& r) {
+    for (int a = 0; a < 3; a++) {
+      o[a] = (float)r.o[a];
+      d[a] = (float)r.d[a];
+      inv_d[a] = (float)r.inv_d[a];
+      sign[a] = r.sign[a];
+    }
+  }
+
+  float o[3];      ///< origin
+  float d[3];      ///< direction
+  float inv_d[3];  ///< component wise inverse of the direction
+  int sign[3];     ///< fast ray-bbox intersection
+};
+
 // structure used for logging rays for subsequent visualization
 struct LoggedRay {
 
@@ -2,6 +2,9 @@
 #include "bsdf.h"
 #include "pathtracer/ray.h"
 
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <stack>
 #include <random>
 #include <algorithm>
@@ -25,6 +28,28 @@ using std::max;
 
 namespace CGL {
 
+// Side of the square pixel blocks traced together as one ray packet.
+static const size_t kPacketBlockSize = 4;
+static_assert(kPacketBlockSize * kPacketBlockSize <= kRayPacketSize,
+              "a pixel block must fit in a ray packet");
+
+// Tiles are split for idle workers near the end of a frame until their
+// sides are at most this long.
+static const size_t kMinSplitTileSize = 8;
+
+// An automatic tile size gives each worker about this many tiles, so the
+// last tiles of a frame are short next to the whole while the cost of
+// scheduling a tile stays small against tracing it.
+static const size_t kAutoTilesPerWorker = 16;
+
+// Bounds of automatic tile sides.
+static const size_t kMinAutoTileSize = 16;
+static const size_t kMaxAutoTileSize = 64;
+
+// With image adaptive sampling, a pixel takes at most this many times the
+// average samples per pixel of the budget.
+static const size_t kMaxAdaptiveSampleRate = 8;
+
 /**
  * Raytraced Renderer is a render controller that in this case.
  * It controls a path tracer to produce an rendered image from the input parameters.
@@ -45,7 +70,8 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
                        float max_tolerance,
                        HDRImageBuffer* envmap,
                        bool direct_hemisphere_sample,
-                       string filename) {
+                       string filename,
+                       const RenderOptions& options) {
   state = INIT;
 
   pt = new PathTracer();
@@ -59,6 +85,9 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
   pt->samplesPerBatch = samples_per_batch;                  // Number of samples per batch
   pt->maxTolerance = max_tolerance;                         // Maximum tolerance for early termination
   pt->direct_hemisphere_sample = direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
+  pt->sampleSequence = options.sample_sequence;             // Sequence the pixel samples draw from
+  pt->multiple_importance_sample = options.integrator == INTEGRATOR_MIS;  // Whether to combine light and BSDF samples
+  pt->misHeuristic = options.mis_heuristic;                 // Weights of multiple importance sampling
 
   this->filename = filename;
 
@@ -69,14 +98,29 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
   }
 
   bvh = NULL;
+  bvhSplitMethod = options.bvh_split_method;
+  lightSampler = NULL;
+  lightSelection = options.light_selection;
+  integrator = options.integrator;
+  wavefront = NULL;
   scene = NULL;
   camera = NULL;
 
   show_rays = true;
 
-  imageTileSize = 32;                     // Size of the rendering tile.
-  numWorkerThreads = num_threads;         // Number of threads
-  workerThreads.resize(numWorkerThreads);
+  tileSize = options.tile_size;               // Size of the rendering tile, 0 for automatic
+  imageTileSize = tileSize ? tileSize : 32;
+  tileOrder = options.tile_order;             // Order the tiles are traced in
+  numWorkerThreads = num_threads;             // Number of threads
+  samplesPerPass = options.samples_per_pass;  // Samples per pixel per progressive pass
+  adaptiveImage = options.adaptive_image;     // Share samples across the image by error
+  timeBudget = options.time_budget;           // Seconds a render may take
+  errorBudget = options.error_budget;         // Mean relative error a render stops at
+  stopReason = "samples";
+  renderTime = 0;
+  workerPool = new ThreadPool(numWorkerThreads, options.pin_threads);
+  tileBuffers.resize(numWorkerThreads);
+  passBarrier = new Barrier(numWorkerThreads);
 }
 
 /**
@@ -85,7 +129,12 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
  */
 RaytracedRenderer::~RaytracedRenderer() {
 
+  continueRaytracing = false;
+  delete workerPool;
+  delete passBarrier;
+  delete wavefront;
   delete bvh;
+  delete lightSampler;
   delete pt;
 
 }
@@ -106,6 +155,7 @@ void RaytracedRenderer::set_scene(Scene *scene) {
   if (this->scene != nullptr) {
     delete scene;
     delete bvh;
+    delete lightSampler;
     selectionHistory.pop();
   }
 
@@ -188,6 +238,8 @@ void RaytracedRenderer::update_screen() {
       visualize_accel();
       break;
     case RENDERING:
+      // Pairs with report_progress, making the finished tiles visible.
+      workDone.load(std::memory_order_acquire);
       glDrawPixels(frameBuffer.w, frameBuffer.h, GL_RGBA,
                    GL_UNSIGNED_BYTE, &frameBuffer.data[0]);
       if (render_cell)
@@ -219,15 +271,35 @@ void RaytracedRenderer::stop() {
     case RENDERING:
       continueRaytracing = false;
     case DONE:
-      for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i]->join();
-            delete workerThreads[i];
-        }
+      workerPool->wait();
       state = READY;
       break;
   }
 }
 
+/**
+ * Ends a render early and keeps the image so far: transitions from
+ * RENDERING to DONE with the samples traced until now.
+ */
+void RaytracedRenderer::finish() {
+  if (state != RENDERING) return;
+  continueRaytracing = false;
+  workerPool->wait();
+
+  // Tiles stopped mid-pass have not written their last samples yet.
+  if (render_cell) {
+    pt->write_to_framebuffer(frameBuffer, cell_tl.x, cell_tl.y, cell_br.x, cell_br.y);
+  } else {
+    pt->write_to_framebuffer(frameBuffer, 0, 0, frame_w, frame_h);
+  }
+  fprintf(stdout, "[PathTracer] Kept the image after %zu passes.\n",
+          wavefront ? workDone.load() : renderPass);
+
+  lock_guard<std::mutex> lk(m_done);
+  state = DONE;
+  cv_done.notify_one();
+}
+
 /**
  * If the pathtracer is in READY, delete all internal data, transition to INIT.
  */
@@ -235,6 +307,8 @@ void RaytracedRenderer::clear() {
   if (state != READY) return;
   delete bvh;
   bvh = NULL;
+  delete lightSampler;
+  lightSampler = NULL;
   scene = NULL;
   camera = NULL;
   selectionHistory.pop();
@@ -262,7 +336,6 @@ void RaytracedRenderer::start_raytracing() {
   if (state != READY) return;
 
   rayLog.clear();
-  workQueue.clear();
 
   state = RENDERING;
   continueRaytracing = true;
@@ -275,49 +348,272 @@ void RaytracedRenderer::start_raytracing() {
   pt->set_frame_size(width, height);
 
   pt->bvh = bvh;
+  pt->lightSampler = lightSampler;
   pt->camera = camera;
   pt->scene = scene;
 
-  if (!render_cell) {
+  delete wavefront;
+  wavefront = NULL;
+
+  // Every pass adds passSamples samples to each pixel, the last one what is
+  // left of ns_aa. Image adaptive and budgeted renders pass a batch per
+  // pixel by default.
+  bool budgeted = adaptiveImage || timeBudget > 0 || errorBudget > 0;
+  size_t default_pass = budgeted ? pt->samplesPerBatch : pt->ns_aa;
+  passSamples = min(samplesPerPass ? samplesPerPass : default_pass, pt->ns_aa);
+  numPasses = (pt->ns_aa + passSamples - 1) / passSamples;
+  renderPass = 0;
+
+  std::vector<WorkItem>& tiles = passTiles;
+  tiles.clear();
+  if (!render_cell && integrator == INTEGRATOR_WAVEFRONT) {
+    frameBuffer.clear();
+    // Progress is counted in samples per pixel rather than pixels.
+    workTotal = pt->ns_aa;
+    workDone = 0;
+    wavefront = new WavefrontIntegrator(pt, numWorkerThreads);
+  } else if (!render_cell) {
     frameBuffer.clear();
-    num_tiles_w = width / imageTileSize + 1;
-    num_tiles_h = height / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
-    tile_samples.resize(num_tiles_w * num_tiles_h);
-    memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+    workTotal = width * height * pt->ns_aa;
+    workDone = 0;
 
     // populate the tile work queue
+    if (tileSize == 0) imageTileSize = auto_tile_size(width, height);
     for (size_t y = 0; y < height; y += imageTileSize) {
         for (size_t x = 0; x < width; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+            tiles.push_back(WorkItem(x, y, min(imageTileSize, width - x),
+                                     min(imageTileSize, height - y)));
         }
     }
+    order_tiles(imageTileSize);
   } else {
     int w = (cell_br-cell_tl).x;
     int h = (cell_br-cell_tl).y;
     int imTS = imageTileSize / 4;
-    num_tiles_w = w / imTS + 1;
-    num_tiles_h = h / imTS + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
-    tile_samples.resize(num_tiles_w * num_tiles_h);
-    memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+    workTotal = w * h * pt->ns_aa;
+    workDone = 0;
 
     // populate the tile work queue
     for (size_t y = cell_tl.y; y < cell_br.y; y += imTS) {
       for (size_t x = cell_tl.x; x < cell_br.x; x += imTS) {
-        workQueue.put_work(WorkItem(x, y, 
+        tiles.push_back(WorkItem(x, y, 
           min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)) ));
       }
     }
+    order_tiles(imTS);
   }
 
+  sampleBudget = workTotal;
+  samplesTaken = 0;
+  plan_pass(0);
+  queue_tiles();
+  workerTiles.assign(numWorkerThreads, 0);
+  workerBusyTime.assign(numWorkerThreads, 0);
+  workerIdleTime.assign(numWorkerThreads, 0);
+
   bvh->total_isects = 0; bvh->total_rays = 0;
-  // launch threads
+  progressShown = -1;
+  stopReason = "samples";
+  renderStart = std::chrono::steady_clock::now();
+  // wake up the worker threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-  for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this);
+  if (wavefront) {
+    workerPool->run([this](size_t i) { wavefront_thread(i); });
+  } else {
+    workerPool->run([this](size_t i) { worker_thread(i); });
+  }
+}
+
+bool RaytracedRenderer::plan_pass(size_t pass) {
+  if (adaptiveImage && !wavefront) {
+    return plan_adaptive_pass(pass);
+  }
+  if (pass >= numPasses) return false;
+
+  size_t num_samples = min(passSamples, pt->ns_aa - pass * passSamples);
+  for (size_t i = 0; i < passTiles.size(); i++) {
+    passTiles[i].num_samples = num_samples;
+  }
+  return true;
+}
+
+bool RaytracedRenderer::plan_adaptive_pass(size_t pass) {
+  size_t num_tiles = passTiles.size();
+  size_t num_pixels = sampleBudget / pt->ns_aa;
+  int max_samples = kMaxAdaptiveSampleRate * pt->ns_aa;
+
+  // Pixel sample limits are raised each pass by the samples planned for it.
+  // The first pass gives every pixel a batch, enough to estimate its error.
+  if (pass == 0) {
+    int num_samples = min(pt->samplesPerBatch, pt->ns_aa);
+    for (size_t i = 0; i < num_tiles; i++) {
+      const WorkItem& tile = passTiles[i];
+      for (int y = tile.tile_y; y < tile.tile_y + tile.tile_h; y++) {
+        for (int x = tile.tile_x; x < tile.tile_x + tile.tile_w; x++) {
+          pt->pixelSamples[x + y * frame_w].limit = num_samples;
+        }
+      }
+      passTiles[i].num_samples = num_samples;
+    }
+    return true;
+  }
+
+  double total_error = 0;
+  size_t taken = 0;
+  size_t converged = 0;
+  for (size_t i = 0; i < num_tiles; i++) {
+    const WorkItem& tile = passTiles[i];
+    for (int y = tile.tile_y; y < tile.tile_y + tile.tile_h; y++) {
+      for (int x = tile.tile_x; x < tile.tile_x + tile.tile_w; x++) {
+        const PixelSamples& pixel = pt->pixelSamples[x + y * frame_w];
+        taken += pixel.taken;
+        converged += pixel.converged;
+        if (!pixel.converged && pixel.taken < max_samples) {
+          total_error += pixel.error();
+        }
+      }
+    }
+  }
+  samplesTaken = taken;
+  workDone.store(taken);
+
+  // Share the next part of the budget, passSamples per pixel, among the
+  // pixels in proportion to their error. A tile takes as many samples as
+  // its neediest pixel; the limits stop the others early. Less than a
+  // sample per pixel is not worth another pass.
+  double chunk = min(sampleBudget - min(sampleBudget, taken),
+                     passSamples * num_pixels);
+  size_t planned = 0;
+  if (chunk < num_pixels) total_error = 0;
+  for (size_t i = 0; i < num_tiles; i++) {
+    WorkItem& tile = passTiles[i];
+    tile.num_samples = 0;
+    for (int y = tile.tile_y; y < tile.tile_y + tile.tile_h; y++) {
+      for (int x = tile.tile_x; x < tile.tile_x + tile.tile_w; x++) {
+        PixelSamples& pixel = pt->pixelSamples[x + y * frame_w];
+        int num_samples = 0;
+        if (total_error > 0 && !pixel.converged && pixel.taken < max_samples) {
+          num_samples = min(max_samples - pixel.taken,
+                            (int)(chunk * pixel.error() / total_error));
+        }
+        pixel.limit = pixel.taken + num_samples;
+        tile.num_samples = max(tile.num_samples, (size_t)num_samples);
+        planned += num_samples;
+      }
+    }
+  }
+
+  if (planned == 0) {
+    fprintf(stdout, "\r[PathTracer] Image adaptive sampling: %zu passes, "
+            "%.2f samples per pixel, %.1f%% of pixels converged.\n", pass,
+            (double)taken / num_pixels, 100.0 * converged / num_pixels);
+    return false;
+  }
+  return true;
+}
+
+size_t RaytracedRenderer::auto_tile_size(size_t width, size_t height) const {
+  double side = sqrt((double)(width * height) /
+                     (kAutoTilesPerWorker * numWorkerThreads));
+  size_t size = (size_t)side / kPacketBlockSize * kPacketBlockSize;
+  return min(max(size, kMinAutoTileSize), kMaxAutoTileSize);
+}
+
+// Index of cell (x, y) along the Hilbert curve through an n x n grid, n a
+// power of two.
+static uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += (uint64_t)s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the curve continues in it.
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+// Spreads the bits of v to the even bits of the result.
+static inline uint64_t spread_bits(uint64_t v) {
+  v &= 0xffffffff;
+  v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+  v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+  v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+  v = (v | (v << 2)) & 0x3333333333333333ull;
+  v = (v | (v << 1)) & 0x5555555555555555ull;
+  return v;
+}
+
+void RaytracedRenderer::order_tiles(size_t tile_size) {
+  std::vector<WorkItem>& tiles = passTiles;
+  if (tileOrder == TILE_ORDER_ROWS || tiles.size() < 2) return;
+
+  int x0 = tiles.front().tile_x, y0 = tiles.front().tile_y;
+  uint32_t nx = (tiles.back().tile_x - x0) / tile_size + 1;
+  uint32_t ny = (tiles.back().tile_y - y0) / tile_size + 1;
+  uint32_t n = 1;
+  while (n < max(nx, ny)) n <<= 1;
+
+  std::vector<std::pair<double, size_t> > keys(tiles.size());
+  for (size_t t = 0; t < tiles.size(); t++) {
+    uint32_t i = (tiles[t].tile_x - x0) / tile_size;
+    uint32_t j = (tiles[t].tile_y - y0) / tile_size;
+    double key = 0;
+    switch (tileOrder) {
+      case TILE_ORDER_SPIRAL: {
+        // Square rings around the centre, in half tiles, each walked
+        // around by angle.
+        int dx = 2 * (int)i - (int)(nx - 1);
+        int dy = 2 * (int)j - (int)(ny - 1);
+        double angle = (atan2((double)dy, (double)dx) + PI) / (2 * PI + EPS_D);
+        key = max(std::abs(dx), std::abs(dy)) + angle;
+        break;
+      }
+      case TILE_ORDER_HILBERT:
+        key = (double)hilbert_index(n, i, j);
+        break;
+      case TILE_ORDER_MORTON:
+        key = (double)(spread_bits(i) | (spread_bits(j) << 1));
+        break;
+      default:
+        break;
+    }
+    keys[t] = std::make_pair(key, t);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<WorkItem> sorted(tiles.size());
+  for (size_t t = 0; t < tiles.size(); t++) {
+    sorted[t] = tiles[keys[t].second];
+  }
+  tiles.swap(sorted);
+}
+
+void RaytracedRenderer::queue_tiles() {
+  // Give each worker a contiguous run of tiles, pushed back to front so that
+  // it takes them in order. A spiral is dealt out instead, so that all
+  // workers start at the centre. Leave room for tiles split near the end.
+  workQueue.reset(numWorkerThreads, 2 * passTiles.size() + 16);
+  for (size_t i = 0; i < numWorkerThreads; i++) {
+    if (tileOrder == TILE_ORDER_SPIRAL) {
+      size_t count = (passTiles.size() + numWorkerThreads - 1 - i) / numWorkerThreads;
+      for (size_t k = count; k-- > 0;) {
+        const WorkItem& tile = passTiles[i + k * numWorkerThreads];
+        if (tile.num_samples > 0) workQueue.put_work(i, tile);
+      }
+      continue;
+    }
+    size_t begin = passTiles.size() * i / numWorkerThreads;
+    size_t end = passTiles.size() * (i + 1) / numWorkerThreads;
+    for (size_t t = end; t-- > begin;) {
+      if (passTiles[t].num_samples > 0) workQueue.put_work(i, passTiles[t]);
+    }
   }
 }
 
@@ -328,6 +624,7 @@ void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size
     cv_done.wait(lk, [this]{ return state == DONE; });
     lk.unlock();
     save_image(filename);
+    save_stats(filename);
     fprintf(stdout, "[PathTracer] Job completed.\n");
   } else {
     render_cell = true;
@@ -336,6 +633,7 @@ void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size
     ImageBuffer buffer;
     raytrace_cell(buffer);
     save_image(filename, &buffer);
+    save_stats(filename);
     fprintf(stdout, "[PathTracer] Cell job completed.\n");
   }
 }
@@ -359,9 +657,15 @@ void RaytracedRenderer::build_accel() {
   fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size()); 
   fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, 4, bvhSplitMethod, BVHCostModel(),
+                     workerPool);
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  fprintf(stdout, "[PathTracer] BVH SAH cost %.4f\n", bvh->get_sah_cost());
+
+  // light sampler //
+  lightSampler = make_light_sampler(lightSelection, scene->lights,
+                                    bvh->get_bbox());
 
   // initial visualization //
   selectionHistory.push(bvh->get_root());
@@ -567,11 +871,12 @@ void RaytracedRenderer::key_press(int key) {
 }
 
 /**
- * Raytrace a tile of the scene and update the frame buffer. Is run
- * in a worker thread.
+ * Raytrace a tile of the scene, adding up to num_samples samples to each
+ * pixel, and update the frame buffer. Is run in a worker thread.
  */
 void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
-                               int tile_w, int tile_h) {
+                               int tile_w, int tile_h, size_t num_samples,
+                               TileBuffer& buffer) {
   size_t w = frame_w;
   size_t h = frame_h;
 
@@ -581,18 +886,19 @@ void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_end_x = std::min(tile_start_x + tile_w, w);
   size_t tile_end_y = std::min(tile_start_y + tile_h, h);
 
-  size_t tile_idx_x = tile_x / imageTileSize;
-  size_t tile_idx_y = tile_y / imageTileSize;
-  size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
-
-  for (size_t y = tile_start_y; y < tile_end_y; y++) {
-    if (!continueRaytracing) return;
-    for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      pt->raytrace_pixel(x, y);
+  // Trace the tile in square blocks of pixels that fill a ray packet, into
+  // the worker's own copy of the tile, then commit it in one go. A canceled
+  // tile keeps the rows traced so far.
+  pt->load_tile(buffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  for (size_t y = tile_start_y; y < tile_end_y; y += kPacketBlockSize) {
+    if (!continueRaytracing) break;
+    for (size_t x = tile_start_x; x < tile_end_x; x += kPacketBlockSize) {
+      pt->raytrace_pixels(buffer, x, y, std::min(x + kPacketBlockSize, tile_end_x),
+                          std::min(y + kPacketBlockSize, tile_end_y),
+                          num_samples);
     }
   }
-
-  tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] += 1;
+  pt->commit_tile(buffer);
 
   pt->write_to_framebuffer(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
 }
@@ -625,35 +931,148 @@ void RaytracedRenderer::raytrace_cell(ImageBuffer& buffer) {
   }
 }
 
-void RaytracedRenderer::worker_thread() {
+void RaytracedRenderer::split_tile(size_t worker_id, WorkItem* work) {
+  if (numWorkerThreads == 1 || workQueue.num_queued() >= (int)numWorkerThreads ||
+      workQueue.room(worker_id) < 3) {
+    return;
+  }
+
+  // Halve each side longer than kMinSplitTileSize, keeping the halves
+  // multiples of the packet block size.
+  int split_w = work->tile_w;
+  int split_h = work->tile_h;
+  if (split_w > (int)kMinSplitTileSize) {
+    split_w = (split_w / 2 + kPacketBlockSize - 1) / kPacketBlockSize * kPacketBlockSize;
+  }
+  if (split_h > (int)kMinSplitTileSize) {
+    split_h = (split_h / 2 + kPacketBlockSize - 1) / kPacketBlockSize * kPacketBlockSize;
+  }
+  if (split_w == work->tile_w && split_h == work->tile_h) return;
+
+  WorkItem quadrants[3] = {
+    WorkItem(work->tile_x + split_w, work->tile_y, work->tile_w - split_w, split_h,
+             work->num_samples),
+    WorkItem(work->tile_x, work->tile_y + split_h, split_w, work->tile_h - split_h,
+             work->num_samples),
+    WorkItem(work->tile_x + split_w, work->tile_y + split_h,
+             work->tile_w - split_w, work->tile_h - split_h, work->num_samples)
+  };
+  for (int i = 0; i < 3; i++) {
+    if (quadrants[i].tile_w > 0 && quadrants[i].tile_h > 0) {
+      workQueue.put_work(worker_id, quadrants[i]);
+    }
+  }
+  work->tile_w = split_w;
+  work->tile_h = split_h;
+}
+
+void RaytracedRenderer::worker_thread(size_t worker_id) {
 
   Timer timer;
   timer.start();
 
   WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
-    raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-    { 
-      lock_guard<std::mutex> lk(m_done);
-      ++tilesDone;
-      cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
-      cout.flush();
+  do {
+    while (continueRaytracing && !time_budget_spent()) {
+      if (!workQueue.try_get_work(worker_id, &work)) {
+        // Other workers may still split their tiles; sleep until they do or
+        // the last tile of the pass is finished.
+        if (workQueue.is_done()) break;
+        workQueue.wait_for_work();
+        continue;
+      }
+      split_tile(worker_id, &work);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h,
+                    work.num_samples, tileBuffers[worker_id]);
+      workerBusyTime[worker_id] += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+      workerTiles[worker_id]++;
+      workQueue.finish_work();
+      // Image adaptive passes count the samples of the neediest pixel of a
+      // tile for all of its pixels, so overestimate.
+      report_progress(work.tile_w * work.tile_h * work.num_samples);
+    }
+
+    // Start the next pass once every worker is done with this one.
+    passBarrier->wait();
+    if (worker_id == 0) {
+      renderPass++;
+      nextPass = continueRaytracing && !budget_spent() && plan_pass(renderPass);
+      if (nextPass) queue_tiles();
+    }
+    passBarrier->wait();
+  } while (nextPass);
+
+  timer.stop();
+  workerIdleTime[worker_id] = timer.duration() - workerBusyTime[worker_id];
+  worker_done(timer);
+}
+
+void RaytracedRenderer::wavefront_thread(size_t thread_id) {
+
+  Timer timer;
+  timer.start();
+
+  // Only thread 0 decides whether to go on. Each thread encodes its own band
+  // of rows for display; the next sample starts after all bands are done.
+  size_t band_start = frameBuffer.h * thread_id / numWorkerThreads;
+  size_t band_end = frameBuffer.h * (thread_id + 1) / numWorkerThreads;
+  while (wavefront->render_sample(thread_id, thread_id > 0 ||
+                                  (continueRaytracing && !budget_spent()))) {
+    pt->write_to_framebuffer(frameBuffer, 0, band_start, frameBuffer.w, band_end);
+    if (thread_id == 0) {
+      report_progress(1);
     }
   }
 
-  workerDoneCount++;
-  if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
+  worker_done(timer);
+}
+
+void RaytracedRenderer::report_progress(size_t work) {
+  size_t done = workDone.fetch_add(work, std::memory_order_release) + work;
+  int percent = int(min(1.0, (double)done / workTotal) * 100);
+
+  // Whoever moves the percentage on prints it; nobody waits for a lock.
+  int shown = progressShown.load(std::memory_order_relaxed);
+  while (percent > shown) {
+    if (progressShown.compare_exchange_weak(shown, percent)) {
+      fprintf(stdout, "\r[PathTracer] Rendering... %d%%", percent);
+      fflush(stdout);
+      break;
+    }
+  }
+}
+
+void RaytracedRenderer::worker_done(Timer& timer) {
+  bool last = ++workerDoneCount == numWorkerThreads;
+  if (!continueRaytracing && last) {
     timer.stop();
     fprintf(stdout, "\n[PathTracer] Rendering canceled!\n");
     state = READY;
   }
 
-  if (continueRaytracing && workerDoneCount == numWorkerThreads) {
+  if (continueRaytracing && last) {
     timer.stop();
-    fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
-    fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
-    fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)bvh->total_rays / timer.duration() * 1e-6);
-    fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    renderTime = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - renderStart).count();
+    if (stopReason != string("samples")) {
+      fprintf(stdout, "\n[PathTracer] Rendering stopped, %s budget spent! (%.4fs)\n",
+              stopReason, timer.duration());
+    } else {
+      fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
+    }
+    unsigned long long rays = bvh->total_rays, isects = bvh->total_isects;
+    fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", rays);
+    fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)rays / timer.duration() * 1e-6);
+    fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)isects)/rays));
+    if (!wavefront) {
+      for (size_t i = 0; i < numWorkerThreads; i++) {
+        fprintf(stdout, "[PathTracer] Thread %zu: %zu tiles, busy %.4fs, idle %.4fs.\n",
+                i, workerTiles[i], workerBusyTime[i], workerIdleTime[i]);
+      }
+    }
 
     lock_guard<std::mutex> lk(m_done);
     state = DONE;
@@ -661,6 +1080,96 @@ void RaytracedRenderer::worker_thread() {
   }
 }
 
+bool RaytracedRenderer::time_budget_spent() const {
+  return timeBudget > 0 && std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - renderStart).count() >= timeBudget;
+}
+
+bool RaytracedRenderer::budget_spent() {
+  if (time_budget_spent()) {
+    stopReason = "time";
+    return true;
+  }
+  if (errorBudget > 0 && mean_pixel_error() <= errorBudget) {
+    stopReason = "error";
+    return true;
+  }
+  return false;
+}
+
+void RaytracedRenderer::render_region(size_t* x0, size_t* y0,
+                                      size_t* x1, size_t* y1) const {
+  if (render_cell) {
+    *x0 = cell_tl.x; *y0 = cell_tl.y;
+    *x1 = cell_br.x; *y1 = cell_br.y;
+  } else {
+    *x0 = 0; *y0 = 0;
+    *x1 = frame_w; *y1 = frame_h;
+  }
+}
+
+double RaytracedRenderer::mean_pixel_error() const {
+  size_t x0, y0, x1, y1;
+  render_region(&x0, &y0, &x1, &y1);
+
+  double sum = 0;
+  size_t count = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      const PixelSamples& pixel = pt->pixelSamples[x + y * frame_w];
+      if (pixel.illum_sum <= 0) continue;
+      if (pixel.taken < 2) return INF_D;
+      sum += pixel.error();
+      count++;
+    }
+  }
+  return count ? sum / count : 0;
+}
+
+void RaytracedRenderer::save_stats(string filename) {
+  if (state != DONE) return;
+
+  size_t x0, y0, x1, y1;
+  render_region(&x0, &y0, &x1, &y1);
+  size_t num_pixels = (x1 - x0) * (y1 - y0);
+  size_t total = 0;
+  int min_spp = num_pixels ? INT_MAX : 0;
+  int max_spp = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      int n = pt->pixelSamples[x + y * frame_w].taken;
+      total += n;
+      min_spp = min(min_spp, n);
+      max_spp = max(max_spp, n);
+    }
+  }
+  double error = mean_pixel_error();
+
+  string stats_filename = filename.substr(0, filename.size() - 4) + "_stats.json";
+  FILE* file = fopen(stats_filename.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "[PathTracer] Could not write %s\n", stats_filename.c_str());
+    return;
+  }
+  fprintf(file, "{\n");
+  fprintf(file, "  \"width\": %zu,\n", x1 - x0);
+  fprintf(file, "  \"height\": %zu,\n", y1 - y0);
+  fprintf(file, "  \"spp\": %.4f,\n", num_pixels ? (double)total / num_pixels : 0.0);
+  fprintf(file, "  \"spp_min\": %d,\n", min_spp);
+  fprintf(file, "  \"spp_max\": %d,\n", max_spp);
+  fprintf(file, "  \"spp_limit\": %zu,\n", pt->ns_aa);
+  fprintf(file, "  \"passes\": %zu,\n", wavefront ? workDone.load() : renderPass);
+  fprintf(file, "  \"mean_relative_error\": %.6f,\n", std::isinf(error) ? -1.0 : error);
+  fprintf(file, "  \"elapsed_seconds\": %.4f,\n", renderTime);
+  fprintf(file, "  \"rays\": %llu,\n", bvh->total_rays.load());
+  fprintf(file, "  \"rays_per_second\": %.1f,\n",
+          renderTime > 0 ? bvh->total_rays / renderTime : 0.0);
+  fprintf(file, "  \"stop_reason\": \"%s\"\n", stopReason);
+  fprintf(file, "}\n");
+  fclose(file);
+  fprintf(stdout, "[PathTracer] Saved render stats to %s\n", stats_filename.c_str());
+}
+
 void RaytracedRenderer::save_image(string filename, ImageBuffer* buffer) {
 
   if (state != DONE) return;
@@ -706,9 +1215,16 @@ void RaytracedRenderer::save_sampling_rate_image(string filename) {
   size_t h = frameBuffer.h;
   ImageBuffer outputBuffer(w, h);
 
+  // Rates are relative to ns_aa, or to the busiest pixel if image adaptive
+  // sampling gave some pixels more.
+  int max_count = pt->ns_aa;
+  for (size_t i = 0; i < w * h; i++) {
+    max_count = max(max_count, pt->sampleCountBuffer[i]);
+  }
+
   for (int x = 0; x < w; x++) {
       for (int y = 0; y < h; y++) {
-          float samplingRate = pt->sampleCountBuffer[y * w + x] * 1.0f / pt->ns_aa;
+          float samplingRate = pt->sampleCountBuffer[y * w + x] * 1.0f / max_count;
 
           Color c;
           if (samplingRate <= 0.5) {
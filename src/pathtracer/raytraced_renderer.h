@@ -1,6 +1,7 @@
 #ifndef CGL_RAYTRACER_H
 #define CGL_RAYTRACER_H
 
+#include <chrono>
 #include <stack>
 #include <thread>
 #include <atomic>
@@ -14,8 +15,10 @@
 #include "scene/bvh.h"
 #include "pathtracer/camera.h"
 #include "pathtracer/sampler.h"
+#include "util/barrier.h"
 #include "util/image.h"
-#include "util/work_queue.h"
+#include "util/thread_pool.h"
+#include "util/work_stealing_queue.h"
 #include "pathtracer/intersection.h"
 
 #include "application/renderer.h"
@@ -30,21 +33,68 @@ using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
 
 #include "pathtracer.h"
+#include "wavefront.h"
 
 namespace CGL {
 
+/**
+ * Order in which the tiles of a frame are handed out.
+ */
+enum TileOrder {
+  TILE_ORDER_ROWS,     ///< row by row from the top left
+  TILE_ORDER_SPIRAL,   ///< outwards from the centre, shared by all workers
+  TILE_ORDER_HILBERT,  ///< along a Hilbert curve, a compact run per worker
+  TILE_ORDER_MORTON    ///< along a Z-order curve, a compact run per worker
+};
+
+/**
+ * How a RaytracedRenderer builds its BVH, integrates, schedules its threads
+ * and spends its samples. The defaults render the whole image in one pass
+ * with the recursive integrator.
+ */
+struct RenderOptions {
+
+  RenderOptions()
+      : bvh_split_method(SceneObjects::BVH_SPLIT_SAH),
+        integrator(INTEGRATOR_RECURSIVE),
+        pin_threads(false),
+        samples_per_pass(0),
+        adaptive_image(false),
+        time_budget(0),
+        error_budget(0),
+        tile_size(32),
+        tile_order(TILE_ORDER_ROWS),
+        sample_sequence(SEQUENCE_RANDOM),
+        light_selection(SceneObjects::LIGHT_SELECT_ALL),
+        mis_heuristic(MIS_POWER) { }
+
+  SceneObjects::BVHSplitMethod bvh_split_method;  ///< how BVH nodes are split
+  PathTracerIntegrator integrator;  ///< how paths are traced
+  bool pin_threads;                 ///< bind each render thread to one CPU
+  size_t samples_per_pass;          ///< samples per pixel per pass, 0 for one pass
+  bool adaptive_image;              ///< share samples across the image by error
+  double time_budget;               ///< seconds a render may take, 0 for no limit
+  float error_budget;               ///< mean relative error to stop at, 0 for none
+  size_t tile_size;                 ///< side of the tiles, 0 for automatic
+  TileOrder tile_order;             ///< order the tiles are handed out in
+  SampleSequence sample_sequence;   ///< sequence the pixel samples draw from
+  SceneObjects::LightSelection light_selection;  ///< how lights are picked
+  MISHeuristic mis_heuristic;       ///< weights of multiple importance sampling
+};
+
 struct WorkItem {
 
   // Default constructor.
   WorkItem() : WorkItem(0, 0, 0, 0) { }
 
-  WorkItem(int x, int y, int w, int h)
-      : tile_x(x), tile_y(y), tile_w(w), tile_h(h) {}
+  WorkItem(int x, int y, int w, int h, size_t num_samples = 0)
+      : tile_x(x), tile_y(y), tile_w(w), tile_h(h), num_samples(num_samples) {}
 
   int tile_x;
   int tile_y;
   int tile_w;
   int tile_h;
+  size_t num_samples;  ///< samples per pixel to add in this pass
 
 };
 
@@ -72,7 +122,8 @@ public:
              float max_tolerance = 0.05f,
              HDRImageBuffer* envmap = NULL,
              bool direct_hemisphere_sample = false,
-             string filename = "");
+             string filename = "",
+             const RenderOptions& options = RenderOptions());
 
   /**
    * Destructor.
@@ -120,6 +171,12 @@ public:
    */
   void stop();
 
+  /**
+   * Ends a render early and keeps the image so far: transitions from
+   * RENDERING to DONE with the samples traced until now.
+   */
+  void finish();
+
   /**
    * If the pathtracer is in READY, delete all internal data, transition to INIT.
    */
@@ -154,6 +211,12 @@ public:
    */
   void save_sampling_rate_image(std::string filename);
 
+  /**
+   * Writes the samples per pixel, time and ray throughput of the last render
+   * to a JSON file next to the png file filename.
+   */
+  void save_stats(std::string filename);
+
  private:
 
   /**
@@ -174,15 +237,94 @@ public:
   void visualize_cell() const;
 
   /**
-   * Raytrace a tile of the scene and update the frame buffer. Is run
-   * in a worker thread.
+   * Raytrace a tile of the scene, adding up to num_samples samples to each
+   * pixel through buffer, and update the frame buffer. Is run in a worker
+   * thread.
+   */
+  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h,
+                     size_t num_samples, TileBuffer& buffer);
+
+  /**
+   * Sets the samples per pixel of each of passTiles for pass number pass.
+   * \return false if the render is complete
+   */
+  bool plan_pass(size_t pass);
+
+  /**
+   * Image adaptive version of plan_pass: shares the next part of the sample
+   * budget among the pixels in proportion to their relative error, through
+   * their sample limits.
+   */
+  bool plan_adaptive_pass(size_t pass);
+
+  /**
+   * Tile side for a width x height frame when the tile size is automatic.
+   */
+  size_t auto_tile_size(size_t width, size_t height) const;
+
+  /**
+   * Sorts passTiles, laid out on a grid of tile_size pixels in row order,
+   * into tileOrder.
+   */
+  void order_tiles(size_t tile_size);
+
+  /**
+   * Queues the tiles of passTiles that take samples in the next pass, giving
+   * each worker a contiguous run, or every worker-th tile for the spiral
+   * order. Not thread safe.
+   */
+  void queue_tiles();
+
+  /**
+   * If the other workers are running out of tiles, splits work into
+   * quadrants, queues all but the first for them to steal and shrinks work
+   * to the first.
    */
-  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+  void split_tile(size_t worker_id, WorkItem* work);
 
   /**
    * Implementation of a ray tracer worker thread
    */
-  void worker_thread();
+  void worker_thread(size_t worker_id);
+
+  /**
+   * Worker thread of the wavefront integrator, which renders full frames
+   * sample by sample instead of tile by tile.
+   */
+  void wavefront_thread(size_t thread_id);
+
+  /**
+   * Adds work to workDone once it is in the frame buffer, and prints the
+   * progress if it reached a new percentage.
+   */
+  void report_progress(size_t work);
+
+  /**
+   * Reports the end of a worker thread, and of the render after the last.
+   */
+  void worker_done(Timer& timer);
+
+  /**
+   * Whether the render has run out of time.
+   */
+  bool time_budget_spent() const;
+
+  /**
+   * Whether the render should end instead of starting another pass because
+   * its time or error budget is spent. Records the reason in stopReason.
+   */
+  bool budget_spent();
+
+  /**
+   * Pixels [x0, x1) x [y0, y1) of the frame that the render covers.
+   */
+  void render_region(size_t* x0, size_t* y0, size_t* x1, size_t* y1) const;
+
+  /**
+   * Mean of PathTracer::pixel_error over the rendered pixels that receive
+   * light; infinite while some of them have too few samples to tell.
+   */
+  double mean_pixel_error() const;
 
   enum State {
     INIT,               ///< to be initialized
@@ -202,15 +344,16 @@ public:
 
   // Integration state //
 
-  vector<int> tile_samples; ///< current sample rate for tile
-  size_t num_tiles_w;       ///< number of tiles along width of the image
-  size_t num_tiles_h;       ///< number of tiles along height of the image
-
   size_t frame_w, frame_h;
 
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  SceneObjects::BVHSplitMethod bvhSplitMethod; ///< BVH construction strategy
+  SceneObjects::LightSampler* lightSampler;    ///< picks lights, NULL to sample all
+  SceneObjects::LightSelection lightSelection; ///< how direct lighting picks lights
+  PathTracerIntegrator integrator;  ///< integrator for full frame renders
+  WavefrontIntegrator* wavefront;   ///< state of the wavefront integrator
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
 
@@ -219,16 +362,54 @@ public:
   // Internals //
 
   size_t numWorkerThreads;
-  size_t imageTileSize;
+  size_t tileSize;                  ///< tile side setting, 0 to pick per frame
+  size_t imageTileSize;             ///< tile side of the current render
+  TileOrder tileOrder;              ///< order tiles are handed out in
+
+  // Progressive rendering: tiles are traced in passes that each add up to
+  // passSamples samples to every pixel, and every pass finishes before the
+  // next starts, so the whole image refines at once.
+  size_t samplesPerPass;            ///< samples per pixel per pass, 0 for ns_aa
+  size_t passSamples;               ///< samples per pixel of the current render's passes
+  size_t numPasses;                 ///< passes in the current render, if known
+  size_t renderPass;                ///< index of the pass being traced
+  bool nextPass;                    ///< decision of worker 0 to start another pass
+  std::vector<WorkItem> passTiles;  ///< tiles traced in every pass
+  Barrier* passBarrier;             ///< workers meet here between passes
+
+  // Image adaptive sampling: after a first uniform pass, each pass spends
+  // about as many samples as the first, on the pixels with the largest
+  // relative error, until the budget of ns_aa samples per pixel is spent or
+  // all pixels have converged.
+  bool adaptiveImage;               ///< sample the whole image adaptively
+  size_t sampleBudget;              ///< samples to spend in the current render
+  size_t samplesTaken;              ///< samples spent after the last pass
+
+  // Budgets of headless jobs. Time is checked between tiles, error between
+  // passes; either makes passes progressive, a batch each by default.
+  double timeBudget;                ///< seconds a render may take, 0 for no limit
+  float errorBudget;                ///< mean relative pixel error to reach, 0 for none
+  const char* stopReason;           ///< what ended the last render
+  std::chrono::steady_clock::time_point renderStart;  ///< start of the last render
+  double renderTime;                ///< seconds the last render took
 
   bool continueRaytracing;                  ///< rendering should continue
-  std::vector<std::thread*> workerThreads;  ///< pool of worker threads
+  ThreadPool* workerPool;                   ///< pool of worker threads
   std::atomic<int> workerDoneCount;         ///< worker threads management
-  WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+  WorkStealingQueue<WorkItem> workQueue;    ///< queue of work for the workers
   std::condition_variable cv_done;
   std::mutex m_done;
-  size_t tilesDone;
-  size_t tilesTotal;
+  std::vector<TileBuffer> tileBuffers;  ///< tile being traced by each worker
+
+  // Finished tiles announce themselves by adding to workDone, after their
+  // pixels are in the frame buffer; the viewer reads it before drawing.
+  std::atomic<size_t> workDone;  ///< pixel samples of finished tiles, or wavefront passes
+  size_t workTotal;              ///< pixel samples, or wavefront passes, in the render
+  std::atomic<int> progressShown;  ///< percentage last printed
+
+  std::vector<size_t> workerTiles;      ///< tiles rendered by each worker
+  std::vector<double> workerBusyTime;   ///< seconds each worker traced tiles
+  std::vector<double> workerIdleTime;   ///< seconds each worker waited
 
   // Visualizer Controls //
 
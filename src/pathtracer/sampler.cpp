@@ -5,19 +5,19 @@ namespace CGL {
 /**
  * A Sampler2D implementation with uniform distribution on unit square
  */
-Vector2D UniformGridSampler2D::get_sample() const {
+Vector2D UniformGridSampler2D::get_sample(SamplerState& rng) const {
 
-  return Vector2D(random_uniform(), random_uniform());
+  return Vector2D(random_uniform(rng), random_uniform(rng));
 
 }
 
 /**
  * A Sampler3D implementation with uniform distribution on unit hemisphere
  */
-Vector3D UniformHemisphereSampler3D::get_sample() const {
+Vector3D UniformHemisphereSampler3D::get_sample(SamplerState& rng) const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  double Xi1 = random_uniform(rng);
+  double Xi2 = random_uniform(rng);
 
   double theta = acos(Xi1);
   double phi = 2.0 * PI * Xi2;
@@ -34,19 +34,20 @@ Vector3D UniformHemisphereSampler3D::get_sample() const {
  * A Sampler3D implementation with cosine-weighted distribution on unit
  * hemisphere. This function does not return the pdf.
  */
-Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
+Vector3D CosineWeightedHemisphereSampler3D::get_sample(SamplerState& rng) const {
   float f;
-  return get_sample(&f);
+  return get_sample(rng, &f);
 }
 
 /**
  * A Sampler3D implementation with cosine-weighted distribution on unit
  * hemisphere. This functions also sets the pdf to the proper probability
  */
-Vector3D CosineWeightedHemisphereSampler3D::get_sample(float *pdf) const {
+Vector3D CosineWeightedHemisphereSampler3D::get_sample(SamplerState& rng,
+                                                       float *pdf) const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  double Xi1 = random_uniform(rng);
+  double Xi2 = random_uniform(rng);
 
   double r = sqrt(Xi1);
   double theta = 2. * PI * Xi2;
@@ -22,8 +22,9 @@ class Sampler2D {
   /**
    * Use the Sampler2D to obtain a Vector2D sample
    * according to the particular sampler's distribution.
+   * \param rng random number stream to draw from
    */
-  virtual Vector2D get_sample() const = 0;
+  virtual Vector2D get_sample(SamplerState& rng) const = 0;
 
 }; // class Sampler2D
 
@@ -41,8 +42,9 @@ class Sampler3D {
   /**
    * Use the Sampler3D to obtain a Vector3D sample
    * according to the particular sampler's distribution.
+   * \param rng random number stream to draw from
    */
-  virtual Vector3D get_sample() const = 0;
+  virtual Vector3D get_sample(SamplerState& rng) const = 0;
 
 }; // class Sampler3D
 
@@ -53,7 +55,7 @@ class Sampler3D {
 class UniformGridSampler2D : public Sampler2D {
  public:
 
-  Vector2D get_sample() const;
+  Vector2D get_sample(SamplerState& rng) const;
 
 }; // class UniformSampler2D
 
@@ -63,7 +65,7 @@ class UniformGridSampler2D : public Sampler2D {
 class UniformHemisphereSampler3D : public Sampler3D {
  public:
 
-  Vector3D get_sample() const;
+  Vector3D get_sample(SamplerState& rng) const;
 
 }; // class UniformHemisphereSampler3D
 
@@ -74,9 +76,9 @@ class UniformHemisphereSampler3D : public Sampler3D {
 class CosineWeightedHemisphereSampler3D : public Sampler3D {
  public:
 
-  Vector3D get_sample() const;
+  Vector3D get_sample(SamplerState& rng) const;
   // Also returns the pdf at the sample point for use in importance sampling.
-  Vector3D get_sample(float* pdf) const;
+  Vector3D get_sample(SamplerState& rng, float* pdf) const;
 
 }; // class UniformHemisphereSampler3D
 
@@ -0,0 +1,325 @@
+#include "wavefront.h"
+
+#include <algorithm>
+
+#include "scene/light.h"
+
+using namespace CGL::SceneObjects;
+
+namespace CGL {
+
+// Largest number of paths in flight; bounds the queue and shadow ray memory.
+static const size_t kWaveSize = 1 << 14;
+
+void WavefrontIntegrator::PathQueue::resize(size_t n) {
+  sample.resize(n);
+  ray.resize(n, Ray(Vector3D(), Vector3D(0, 0, 1)));
+  isect.resize(n);
+  path.resize(n);
+  rng.resize(n);
+  alive.resize(n);
+}
+
+WavefrontIntegrator::WavefrontIntegrator(PathTracer* pt, size_t num_threads)
+    : pt(pt), num_threads(num_threads), barrier(num_threads),
+      sample_index(0), running(true) {
+
+  size_t num_pixels = pt->sampleBuffer.w * pt->sampleBuffer.h;
+  active_pixels.resize(num_pixels);
+  for (size_t p = 0; p < num_pixels; p++) {
+    active_pixels[p] = p;
+  }
+  alive_counts.resize(num_threads);
+
+  // estimate_direct_lighting_importance divides its running sum by the
+  // sample count of each light after adding that light's samples, so the
+  // samples of light j end up scaled by the inverse counts of lights j, j+1...
+  // With a light sampler it takes ns_area_light samples of picked lights.
+  const std::vector<SceneLight*>& lights = pt->scene->lights;
+  light_scale.resize(lights.size());
+  shadows_per_path = 0;
+  double scale = 1;
+  for (size_t j = lights.size(); j-- > 0;) {
+    size_t num_samples = lights[j]->is_delta_light() ? 1 : pt->ns_area_light;
+    scale /= num_samples;
+    light_scale[j] = scale;
+    if (!pt->direct_hemisphere_sample) shadows_per_path += num_samples;
+  }
+  if (pt->lightSampler && !pt->direct_hemisphere_sample) {
+    shadows_per_path = pt->ns_area_light;
+  }
+
+  size_t wave_size = std::min(kWaveSize, num_pixels);
+  queues[0].resize(wave_size);
+  queues[1].resize(wave_size);
+  sample_radiance.resize(wave_size);
+  shadow_o.resize(wave_size * shadows_per_path);
+  shadow_d.resize(wave_size * shadows_per_path);
+  shadow_max_t.resize(wave_size * shadows_per_path);
+  shadow_L.resize(wave_size * shadows_per_path);
+}
+
+void WavefrontIntegrator::thread_range(size_t thread_id, size_t n,
+                                       size_t align, size_t* begin,
+                                       size_t* end) const {
+  size_t blocks = (n + align - 1) / align;
+  *begin = std::min(n, blocks * thread_id / num_threads * align);
+  *end = std::min(n, blocks * (thread_id + 1) / num_threads * align);
+}
+
+bool WavefrontIntegrator::render_sample(size_t thread_id, bool keep_going) {
+  if (thread_id == 0) {
+    running = keep_going && sample_index < pt->ns_aa && !active_pixels.empty();
+  }
+  barrier.wait();
+  if (!running) return false;
+
+  for (size_t wave_begin = 0; wave_begin < active_pixels.size();
+       wave_begin += kWaveSize) {
+    trace_wave(thread_id, wave_begin,
+               std::min(wave_begin + kWaveSize, active_pixels.size()));
+  }
+
+  // Drop the pixels that have converged from the next sample.
+  if (thread_id == 0) {
+    size_t w = pt->sampleBuffer.w;
+    size_t n = 0;
+    for (size_t i = 0; i < active_pixels.size(); i++) {
+      size_t p = active_pixels[i];
+      if (pt->pixel_active(p % w, p / w)) active_pixels[n++] = p;
+    }
+    active_pixels.resize(n);
+    sample_index++;
+  }
+  barrier.wait();
+  return true;
+}
+
+void WavefrontIntegrator::trace_wave(size_t thread_id, size_t wave_begin,
+                                     size_t wave_end) {
+  size_t n = wave_end - wave_begin;
+  size_t begin, end;
+
+  // Camera rays are traced as packets, so hand them out in whole packets.
+  thread_range(thread_id, n, SceneObjects::kRayPacketSize, &begin, &end);
+  generate(queues[0], begin, end, wave_begin);
+
+  int cur = 0;
+  bool camera = true;
+  while (n > 0) {
+    PathQueue& q = queues[cur];
+    extend(q, begin, end, camera);
+    shade(q, begin, end);
+    trace_shadows(q, begin, end);
+
+    // Compact the surviving paths into the other queue, keeping their order.
+    size_t alive = 0;
+    for (size_t i = begin; i < end; i++) {
+      alive += q.alive[i];
+    }
+    alive_counts[thread_id] = alive;
+    barrier.wait();
+
+    size_t offset = 0;
+    size_t total = 0;
+    for (size_t t = 0; t < num_threads; t++) {
+      if (t < thread_id) offset += alive_counts[t];
+      total += alive_counts[t];
+    }
+    PathQueue& next = queues[1 - cur];
+    for (size_t i = begin; i < end; i++) {
+      if (!q.alive[i]) continue;
+      next.sample[offset] = q.sample[i];
+      next.ray[offset] = q.ray[i];
+      next.path[offset] = q.path[i];
+      next.rng[offset] = q.rng[i];
+      offset++;
+    }
+    barrier.wait();
+
+    cur = 1 - cur;
+    camera = false;
+    n = total;
+    thread_range(thread_id, n, 1, &begin, &end);
+  }
+
+  thread_range(thread_id, wave_end - wave_begin, 1, &begin, &end);
+  accumulate(begin, end, wave_begin);
+  barrier.wait();
+}
+
+void WavefrontIntegrator::generate(PathQueue& q, size_t begin, size_t end,
+                                   size_t wave_begin) {
+  size_t w = pt->sampleBuffer.w;
+  size_t h = pt->sampleBuffer.h;
+  for (size_t i = begin; i < end; i++) {
+    size_t p = active_pixels[wave_begin + i];
+    q.rng[i] = SamplerState(p, sample_index, pt->sampleSequence);
+    Vector2D sample = pt->gridSampler->get_sample(q.rng[i]);
+    double x_normal = (sample.x + p % w) / w;
+    double y_normal = (sample.y + p / w) / h;
+    q.ray[i] = pt->camera->generate_ray(x_normal, y_normal);
+    q.ray[i].depth = pt->max_ray_depth;
+    q.sample[i] = i;
+    q.path[i] = PathState(pt->max_ray_depth);
+    sample_radiance[i] = Spectrum();
+  }
+}
+
+void WavefrontIntegrator::extend(PathQueue& q, size_t begin, size_t end,
+                                 bool camera) {
+  if (camera) {
+    for (size_t i = begin; i < end; i += SceneObjects::kRayPacketSize) {
+      size_t m = std::min(SceneObjects::kRayPacketSize, end - i);
+      for (size_t k = 0; k < m; k++) {
+        q.isect[i + k] = Intersection();
+      }
+      uint32_t hits = pt->bvh->intersect_packet(&q.ray[i], &q.isect[i],
+                                                (1u << m) - 1);
+      for (size_t k = 0; k < m; k++) {
+        q.alive[i + k] = (hits >> k) & 1;
+        if (!q.alive[i + k] && pt->envLight) {
+          sample_radiance[q.sample[i + k]] += pt->envLight->sample_dir(q.ray[i + k]);
+        }
+      }
+    }
+    return;
+  }
+
+  for (size_t i = begin; i < end; i++) {
+    q.isect[i] = Intersection();
+    q.alive[i] = pt->bvh->intersect(q.ray[i], &q.isect[i]);
+  }
+}
+
+void WavefrontIntegrator::shade(PathQueue& q, size_t begin, size_t end) {
+  const std::vector<SceneLight*>& lights = pt->scene->lights;
+
+  for (size_t i = begin; i < end; i++) {
+    size_t s = i * shadows_per_path;
+    for (size_t k = 0; k < shadows_per_path; k++) {
+      shadow_max_t[s + k] = -1;
+    }
+    if (!q.alive[i]) continue;
+
+    Ray& r = q.ray[i];
+    const Intersection& isect = q.isect[i];
+    PathState& path = q.path[i];
+    const Spectrum& throughput = path.throughput;
+    SamplerState& rng = q.rng[i];
+    Spectrum& L = sample_radiance[q.sample[i]];
+
+    // Emission counts at the camera hit, and once more where the depth
+    // runs out (see at_least_one_bounce_radiance).
+    if (r.depth == pt->max_ray_depth) {
+      L += throughput * isect.bsdf->get_emission();
+    }
+    if (r.depth == 0) {
+      L += throughput * isect.bsdf->get_emission();
+      q.alive[i] = false;
+      continue;
+    }
+
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Matrix3x3 w2o = o2w.T();
+
+    Vector3D hit_p = r.o + r.d * isect.t;
+    Vector3D w_out = w2o * (-r.d);
+
+    // Direct lighting. Light samples become shadow rays for the next stage;
+    // hemisphere samples need the emission of what they hit, so are traced
+    // right away.
+    if (pt->direct_hemisphere_sample) {
+      L += throughput * pt->estimate_direct_lighting_hemisphere(r, isect, rng);
+    } else if (pt->lightSampler) {
+      for (size_t k = 0; k < pt->ns_area_light; k++, s++) {
+        double pmf;
+        const SceneLight* light = pt->lightSampler->sample(hit_p, isect.n, rng,
+                                                           &pmf);
+        if (!light) continue;
+
+        Vector3D wi;
+        float distance;
+        float pdf;
+        Spectrum l_sample = light->sample_L(hit_p, &wi, &distance, &pdf, rng);
+        Vector3D wi_w2o = w2o * wi;
+        if (wi_w2o.z < 0) continue;
+
+        Spectrum f = isect.bsdf->f(w_out, wi_w2o);
+        shadow_o[s] = hit_p + (EPS_D * wi);
+        shadow_d[s] = wi;
+        shadow_max_t[s] = distance * (1 - kShadowEpsilon);
+        shadow_L[s] = throughput * l_sample * f * cos_theta(wi_w2o)
+                      / (pdf * pmf * pt->ns_area_light);
+      }
+    } else {
+      for (size_t j = 0; j < lights.size(); j++) {
+        size_t num_samples = lights[j]->is_delta_light() ? 1 : pt->ns_area_light;
+        for (size_t k = 0; k < num_samples; k++, s++) {
+          Vector3D wi;
+          float distance;
+          float pdf;
+          Spectrum l_sample = lights[j]->sample_L(hit_p, &wi, &distance, &pdf,
+                                                     rng);
+          Vector3D wi_w2o = w2o * wi;
+          if (wi_w2o.z < 0) continue;
+
+          Spectrum f = isect.bsdf->f(w_out, wi_w2o);
+          shadow_o[s] = hit_p + (EPS_D * wi);
+          shadow_d[s] = wi;
+          shadow_max_t[s] = distance * (1 - kShadowEpsilon);
+          shadow_L[s] = throughput * l_sample * f * cos_theta(wi_w2o) / pdf
+                        * light_scale[j];
+        }
+      }
+    }
+
+    if (r.depth == 1) {
+      q.alive[i] = false;
+      continue;
+    }
+
+    Vector3D wi;
+    float pdf;
+    Spectrum f = isect.bsdf->sample_f(w_out, &wi, &pdf, rng);
+    if (f.illum() <= 0 || pdf <= 0) {
+      q.alive[i] = false;
+      continue;
+    }
+    path.bounce(f, pdf, wi, isect.bsdf->is_delta());
+    if (!path.survive_roulette(rng)) {
+      q.alive[i] = false;
+      continue;
+    }
+
+    Vector3D direction = o2w * wi;
+    r = Ray(hit_p + (EPS_D * direction), direction);
+    r.depth = path.depth;
+  }
+}
+
+void WavefrontIntegrator::trace_shadows(PathQueue& q, size_t begin,
+                                        size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    Spectrum& L = sample_radiance[q.sample[i]];
+    for (size_t s = i * shadows_per_path; s < (i + 1) * shadows_per_path; s++) {
+      if (shadow_max_t[s] < 0) continue;
+      Ray shadow(shadow_o[s], shadow_d[s], shadow_max_t[s]);
+      if (!pt->bvh->has_intersection(shadow)) {
+        L += shadow_L[s];
+      }
+    }
+  }
+}
+
+void WavefrontIntegrator::accumulate(size_t begin, size_t end,
+                                     size_t wave_begin) {
+  size_t w = pt->sampleBuffer.w;
+  for (size_t i = begin; i < end; i++) {
+    size_t p = active_pixels[wave_begin + i];
+    pt->accumulate_sample(p % w, p / w, sample_radiance[i]);
+  }
+}
+
+}  // namespace CGL
@@ -0,0 +1,100 @@
+#ifndef CGL_WAVEFRONT_H
+#define CGL_WAVEFRONT_H
+
+#include <vector>
+
+#include "pathtracer/pathtracer.h"
+#include "util/barrier.h"
+
+namespace CGL {
+
+/**
+ * Breadth-first path tracer. Instead of following one camera sample through
+ * all of its bounces before starting the next, it keeps a wave of paths in
+ * structure-of-arrays queues and advances all of them one bounce at a time,
+ * in stages: generate camera rays, extend (closest hit), shade and sample
+ * the BSDF, trace shadow rays, compact away the terminated paths. Every
+ * stage is split across the worker threads, which meet at a barrier before
+ * each compaction.
+ *
+ * The estimator is the one of PathTracer::est_radiance_global_illumination,
+ * and samples are accumulated with PathTracer::accumulate_sample, the same
+ * adaptive sampling as PathTracer::raytrace_pixels, so both integrators
+ * converge to the same image.
+ */
+class WavefrontIntegrator {
+ public:
+
+  /**
+   * Prepares to render the frame of pt, which must be configured with its
+   * scene, camera, BVH and frame size, with num_threads threads.
+   */
+  WavefrontIntegrator(PathTracer* pt, size_t num_threads);
+
+  /**
+   * Traces one more sample of every pixel that has not converged yet, and
+   * writes the running averages to the sample buffer. Must be called by all
+   * num_threads threads, each with its own thread_id.
+   * \param keep_going whether to continue rendering, as seen by thread 0
+   * \return false once the frame is complete or rendering was canceled
+   */
+  bool render_sample(size_t thread_id, bool keep_going);
+
+ private:
+
+  /**
+   * Path states of a wave, one entry per path in each array.
+   */
+  struct PathQueue {
+    std::vector<uint32_t> sample;           ///< sample slot of the path
+    std::vector<Ray> ray;                   ///< ray being extended
+    std::vector<SceneObjects::Intersection> isect;  ///< closest hit of ray
+    std::vector<PathState> path;            ///< state of the path up to ray
+    std::vector<SamplerState> rng;          ///< random stream of the sample
+    std::vector<char> alive;                ///< path continues after shading
+
+    void resize(size_t n);
+  };
+
+  /**
+   * Range [begin, end) of n items processed by thread thread_id, in
+   * multiples of align.
+   */
+  void thread_range(size_t thread_id, size_t n, size_t align,
+                    size_t* begin, size_t* end) const;
+
+  void trace_wave(size_t thread_id, size_t wave_begin, size_t wave_end);
+
+  void generate(PathQueue& q, size_t begin, size_t end, size_t wave_begin);
+  void extend(PathQueue& q, size_t begin, size_t end, bool camera);
+  void shade(PathQueue& q, size_t begin, size_t end);
+  void trace_shadows(PathQueue& q, size_t begin, size_t end);
+  void accumulate(size_t begin, size_t end, size_t wave_begin);
+
+  PathTracer* pt;
+  size_t num_threads;
+  Barrier barrier;
+
+  // Frame state //
+
+  std::vector<uint32_t> active_pixels;  ///< pixels that still take samples
+  size_t sample_index;                ///< index of the sample being traced
+  bool running;                       ///< decision of thread 0 to go on
+
+  // Wave state //
+
+  PathQueue queues[2];                ///< current and compacted paths
+  std::vector<Spectrum> sample_radiance;  ///< radiance of each sample slot
+  std::vector<size_t> alive_counts;   ///< surviving paths of each thread
+
+  size_t shadows_per_path;            ///< shadow ray slots of a path
+  std::vector<double> light_scale;    ///< weight of the samples of a light
+  std::vector<Vector3D> shadow_o;     ///< shadow ray origins
+  std::vector<Vector3D> shadow_d;     ///< shadow ray directions
+  std::vector<double> shadow_max_t;   ///< shadow ray lengths, < 0 if unused
+  std::vector<Spectrum> shadow_L;     ///< contribution if unoccluded
+};
+
+}  // namespace CGL
+
+#endif  // CGL_WAVEFRONT_H
@@ -9,37 +9,20 @@ namespace CGL {
 
 bool BBox::intersect(const Ray& r, double& t0, double& t1) const {
 
-  // TODO (Part 2.2):
-  // Implement ray - bounding box intersection test
-  // If the ray intersected the bouding box within the range given by
-  // t0, t1, update t0 and t1 with the new intersection times.
-    
-    bool intersect = true;
-
-    double t_x1 = (min.x - r.o.x) / r.d.x;
-    double t_x2 = (max.x - r.o.x) / r.d.x;
-    double t_y1 = (min.y - r.o.y) / r.d.y;
-    double t_y2 = (max.y - r.o.y) / r.d.y;
-    double t_z1 = (min.z - r.o.z) / r.d.z;
-    double t_z2 = (max.z - r.o.z) / r.d.z;
-
-    double t_x_min = std::min(t_x1, t_x2);
-    double t_x_max = std::max(t_x1, t_x2);
-    double t_y_min = std::min(t_y1, t_y2);
-    double t_y_max = std::max(t_y1, t_y2);
-    double t_z_min = std::min(t_z1, t_z2);
-    double t_z_max = std::max(t_z1, t_z2);
-
-    double newt0 = std::max({t_x_min, t_y_min, t_z_min});
-    double newt1 = std::min({t_x_max, t_y_max, t_z_max});
-
-    if (newt0 > newt1 || newt1 < 0) {intersect = false;}
-    t0 = newt0;
-    t1 = newt1;
-
-  return intersect;
-    
-
+  // Slab test using the ray's precomputed inverse direction and signs, so
+  // the near and far planes of each slab are picked without a comparison.
+  // If the ray intersects the box within [t0, t1], the range is narrowed to
+  // the part inside the box.
+
+  const Vector3D* bounds[2] = {&min, &max};
+  for (int a = 0; a < 3; a++) {
+    double tnear = ((*bounds[r.sign[a]])[a] - r.o[a]) * r.inv_d[a];
+    double tfar = ((*bounds[1 - r.sign[a]])[a] - r.o[a]) * r.inv_d[a];
+    if (tnear > t0) t0 = tnear;
+    if (tfar < t1) t1 = tfar;
+    if (t0 > t1) return false;
+  }
+  return true;
 }
 
 void BBox::draw(Color c, float alpha) const {
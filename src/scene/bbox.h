@@ -123,8 +123,9 @@ struct BBox {
    * Ray - bbox intersection.
    * Intersects ray with bounding box, does not store shading information.
    * \param r the ray to intersect with
-   * \param t0 lower bound of intersection time
-   * \param t1 upper bound of intersection time
+   * \param t0 lower bound of intersection time, raised to the entry time
+   * \param t1 upper bound of intersection time, lowered to the exit time
+   * \return true if the ray is inside the box for part of [t0, t1]
    */
   bool intersect(const Ray& r, double& t0, double& t1) const;
 
@@ -1,8 +1,12 @@
 #include "bvh.h"
+#include "bvh_kernels.h"
 
 #include "CGL/CGL.h"
 #include "triangle.h"
+#include "util/thread_pool.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <stack>
 
@@ -12,10 +16,38 @@ namespace CGL {
 namespace SceneObjects {
 
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   size_t max_leaf_size, BVHSplitMethod split_method,
+                   const BVHCostModel &cost_model, ThreadPool *pool)
+    : total_rays(0), total_isects(0), split_method(split_method),
+      cost_model(cost_model),
+      build_pool(pool && pool->size() > 0 ? pool : NULL),
+      num_threads(build_pool ? build_pool->size() : 1) {
 
   primitives = std::vector<Primitive *>(_primitives);
-  root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+
+  // On a pool the build runs as a task, so that it and the tasks it forks
+  // all run on the threads of the pool.
+  auto build = [&]() {
+    if (split_method == BVH_SPLIT_LBVH) {
+      root = construct_lbvh(max_leaf_size);
+    } else {
+      root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+    }
+  };
+  if (build_pool) {
+    ThreadPool::TaskGroup group;
+    build_pool->submit(group, build);
+    build_pool->wait(group);
+  } else {
+    build();
+  }
+  build_pool = NULL;
+
+  build_wide_bvh();
+
+  double root_area = root->bb.surface_area();
+  sah_cost = compute_sah_cost(root);
+  if (root_area > 0) sah_cost /= root_area;
 }
 
 BVHAccel::~BVHAccel() {
@@ -48,212 +80,854 @@ void BVHAccel::drawOutline(BVHNode *node, const Color &c, float alpha) const {
   }
 }
 
-//bool compare_x (std::vector<Primitive *>::iterator p1, std::vector<Primitive *>::iterator p2) {
-//    return ((*p1)->get_bbox().centroid().x < (*p2)->get_bbox().centroid().x);
-//}
+// Number of buckets the centroid range is divided into for SAH evaluation.
+static const int kSAHBins = 12;
+
+// Below this depth nodes are split at the object median, which bounds the
+// depth of the tree so that traversal can use a fixed-size stack.
+static const size_t kMedianSplitDepth = 64;
+
+// Each level of the 4-wide tree adds at most three entries to the stack.
+static const size_t kTraversalStackSize = 3 * 128;
+
+// Subtrees with at least this many primitives are built as separate tasks.
+static const size_t kParallelSubtreeSize = 4096;
+
+// Ranges with at least this many primitives compute their bounds and SAH
+// bins in parallel chunks, in practice only the top few levels of the tree.
+static const size_t kParallelBinSize = 65536;
+
+void BVHAccel::parallel_chunks(
+    size_t n, size_t num_chunks,
+    const std::function<void(size_t, size_t, size_t)> &f) {
+  auto chunk = [&](size_t c) {
+    f(c * n / num_chunks, (c + 1) * n / num_chunks, c);
+  };
+
+  if (num_chunks < 2 || !build_pool) {
+    for (size_t c = 0; c < num_chunks; c++) chunk(c);
+    return;
+  }
+
+  ThreadPool::TaskGroup group;
+  for (size_t c = 0; c + 1 < num_chunks; c++) {
+    build_pool->submit(group, [&chunk, c]() { chunk(c); });
+  }
+  chunk(num_chunks - 1);
+  build_pool->wait(group);
+}
+
+static int longest_axis(const Vector3D &extent) {
+  int axis = 0;
+  if (extent.y > extent[axis]) axis = 1;
+  if (extent.z > extent[axis]) axis = 2;
+  return axis;
+}
 
 BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
                                  std::vector<Primitive *>::iterator end,
-                                 size_t max_leaf_size) {
-
-  // TODO (Part 2.1):
-  // Construct a BVH from the given vector of primitives and maximum leaf
-  // size configuration. The starter code build a BVH aggregate with a
-  // single leaf node (which is also the root) that encloses all the
-  // primitives.
-
-  BBox bbox;
-  int k = 0;
-//    Vector3D centriod = Vector3D(0, 0, 0);
-
-  for (auto p = start; p != end; p++) {
-    BBox bb = (*p)->get_bbox();
-    bbox.expand(bb);
-      k += 1;
-//      Vector3D c = bb.centroid();
-//      centriod += (*p)->get_bbox().centroid();
-//      b_centriod.expand(c);
-  }
-    
-//    centriod = centriod / k;
-//    float c_x = centriod.x;
-//    cout << "c_x=" << c_x << endl;
+                                 size_t max_leaf_size, size_t depth) {
+
+  size_t count = end - start;
+
+  // Bounds of the primitives and of their centroids.
+  BBox bbox, cbox;
+  if (count >= kParallelBinSize && num_threads > 1) {
+    std::vector<BBox> bboxes(num_threads), cboxes(num_threads);
+    parallel_chunks(count, num_threads, [&](size_t b, size_t e, size_t c) {
+      for (auto p = start + b; p != start + e; p++) {
+        BBox bb = (*p)->get_bbox();
+        bboxes[c].expand(bb);
+        cboxes[c].expand(bb.centroid());
+      }
+    });
+    for (size_t c = 0; c < num_threads; c++) {
+      bbox.expand(bboxes[c]);
+      cbox.expand(cboxes[c]);
+    }
+  } else {
+    for (auto p = start; p != end; p++) {
+      BBox bb = (*p)->get_bbox();
+      bbox.expand(bb);
+      cbox.expand(bb.centroid());
+    }
+  }
+
   BVHNode *node = new BVHNode(bbox);
-//    cout << "k=" << k << endl;
-    
-    if (k <= max_leaf_size) {
-        node->start = start;
-        node->end = end;
-        return node;
+
+  std::vector<Primitive *>::iterator mid = end;
+  if (depth >= kMedianSplitDepth) {
+    if (count > max_leaf_size) {
+      int axis = longest_axis(cbox.extent);
+      mid = start + count / 2;
+      std::nth_element(start, mid, end, [axis](Primitive *a, Primitive *b) {
+        return a->get_bbox().centroid()[axis] <
+               b->get_bbox().centroid()[axis];
+      });
+    }
+  } else if (count > 1) {
+    switch (split_method) {
+    case BVH_SPLIT_MIDPOINT:
+      if (count > max_leaf_size)
+        mid = split_midpoint(start, end, bbox);
+      break;
+    case BVH_SPLIT_SAH:
+    default:
+      mid = split_sah(start, end, bbox, cbox, max_leaf_size);
+      break;
+    }
+  }
+
+  if (mid == end) {
+    node->start = start;
+    node->end = end;
+    return node;
+  }
+
+  // Hand the left subtree to the pool as a task if it is large enough, and
+  // build the right one on this thread.
+  if (count >= kParallelSubtreeSize && build_pool) {
+    ThreadPool::TaskGroup group;
+    build_pool->submit(group, [&]() {
+      node->l = construct_bvh(start, mid, max_leaf_size, depth + 1);
+    });
+    node->r = construct_bvh(mid, end, max_leaf_size, depth + 1);
+    build_pool->wait(group);
+  } else {
+    node->l = construct_bvh(start, mid, max_leaf_size, depth + 1);
+    node->r = construct_bvh(mid, end, max_leaf_size, depth + 1);
+  }
+  return node;
+}
+
+std::vector<Primitive *>::iterator
+BVHAccel::split_midpoint(std::vector<Primitive *>::iterator start,
+                         std::vector<Primitive *>::iterator end,
+                         const BBox &bbox) const {
+
+  // Split at the middle of the longest axis of the node bounds. If every
+  // centroid lands on one side, fall back to splitting at the median.
+  int axis = longest_axis(bbox.extent);
+  double splitpoint = bbox.min[axis] + bbox.extent[axis] / 2;
+
+  auto mid = std::partition(start, end, [axis, splitpoint](Primitive *p) {
+    return p->get_bbox().centroid()[axis] <= splitpoint;
+  });
+
+  if (mid == start || mid == end) {
+    mid = start + (end - start) / 2;
+  }
+  return mid;
+}
+
+std::vector<Primitive *>::iterator
+BVHAccel::split_sah(std::vector<Primitive *>::iterator start,
+                    std::vector<Primitive *>::iterator end, const BBox &bbox,
+                    const BBox &cbox, size_t max_leaf_size) {
+
+  size_t count = end - start;
+
+  // Bin along the longest axis of the centroid bounds, primitives whose
+  // centroids coincide cannot be separated by any split plane.
+  int axis = longest_axis(cbox.extent);
+  double cmin = cbox.min[axis];
+  double extent = cbox.extent[axis];
+  if (extent <= 0) {
+    return count <= max_leaf_size ? end : start + count / 2;
+  }
+
+  struct Bin {
+    Bin() : count(0) { }
+    BBox bb;
+    size_t count;
+  };
+
+  double scale = kSAHBins / extent;
+  auto bin_of = [axis, cmin, scale](const Primitive *p) {
+    int b = (int)((p->get_bbox().centroid()[axis] - cmin) * scale);
+    return std::min(b, kSAHBins - 1);
+  };
+
+  auto fill_bins = [&](size_t b, size_t e, Bin *bins) {
+    for (auto p = start + b; p != start + e; p++) {
+      Bin &bin = bins[bin_of(*p)];
+      bin.count++;
+      bin.bb.expand((*p)->get_bbox());
+    }
+  };
+
+  // Large ranges are binned in chunks by separate threads and merged.
+  Bin bins[kSAHBins];
+  if (count >= kParallelBinSize && num_threads > 1) {
+    std::vector<Bin> chunk_bins(num_threads * kSAHBins);
+    parallel_chunks(count, num_threads, [&](size_t b, size_t e, size_t c) {
+      fill_bins(b, e, &chunk_bins[c * kSAHBins]);
+    });
+    for (size_t c = 0; c < num_threads; c++) {
+      for (int i = 0; i < kSAHBins; i++) {
+        bins[i].count += chunk_bins[c * kSAHBins + i].count;
+        bins[i].bb.expand(chunk_bins[c * kSAHBins + i].bb);
+      }
+    }
+  } else {
+    fill_bins(0, count, bins);
+  }
+
+  // Sweep from the right to get the area and count of every right side, then
+  // from the left to evaluate each of the kSAHBins - 1 candidate planes.
+  double right_area[kSAHBins - 1];
+  size_t right_count[kSAHBins - 1];
+  BBox acc;
+  size_t acc_count = 0;
+  for (int i = kSAHBins - 1; i > 0; i--) {
+    acc.expand(bins[i].bb);
+    acc_count += bins[i].count;
+    right_area[i - 1] = acc.surface_area();
+    right_count[i - 1] = acc_count;
+  }
+
+  int best_split = -1;
+  double best_cost = INF_D;
+  acc = BBox();
+  acc_count = 0;
+  for (int i = 0; i < kSAHBins - 1; i++) {
+    acc.expand(bins[i].bb);
+    acc_count += bins[i].count;
+    if (acc_count == 0 || right_count[i] == 0) continue;
+
+    double cost = acc_count * acc.surface_area() +
+                  right_count[i] * right_area[i];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_split = i;
+    }
+  }
+
+  if (best_split < 0) {
+    return count <= max_leaf_size ? end : start + count / 2;
+  }
+
+  double leaf_cost = cost_model.intersection_cost * count;
+  double area = bbox.surface_area();
+  double split_cost = area > 0
+      ? cost_model.traversal_cost +
+        cost_model.intersection_cost * best_cost / area
+      : cost_model.traversal_cost + leaf_cost;
+
+  if (count <= max_leaf_size && leaf_cost <= split_cost) {
+    return end;
+  }
+
+  return std::partition(start, end, [&bin_of, best_split](Primitive *p) {
+    return bin_of(p) <= best_split;
+  });
+}
+
+// Spread the lower 21 bits of v so that there are two zero bits between each.
+static inline uint64_t expand_bits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+// 63-bit Morton code of a point given in [0, 1]^3.
+static inline uint64_t morton_code(const Vector3D &p) {
+  const double scale = (1 << 21) - 1;
+  return (expand_bits((uint64_t)(p.x * scale)) << 2) |
+         (expand_bits((uint64_t)(p.y * scale)) << 1) |
+         expand_bits((uint64_t)(p.z * scale));
+}
+
+struct MortonPrimitive {
+  uint64_t code;
+  Primitive *p;
+};
+
+/**
+ * Least significant digit radix sort on the Morton codes, 11 bits per pass.
+ * Each chunk histograms and scatters its own part of the input, the offsets
+ * are laid out chunk by chunk within a digit so the sort stays stable.
+ * parallel_chunks(n, num_chunks, f) runs f on each chunk, as
+ * BVHAccel::parallel_chunks.
+ */
+template <typename Chunks>
+static void radix_sort(std::vector<MortonPrimitive> &v, size_t num_chunks,
+                       const Chunks &parallel_chunks) {
+  const int kDigitBits = 11;
+  const int kNumDigits = 1 << kDigitBits;
+  const int kNumPasses = (63 + kDigitBits - 1) / kDigitBits;
+
+  std::vector<MortonPrimitive> sorted(v.size());
+  std::vector<size_t> offsets(num_chunks * kNumDigits);
+
+  for (int pass = 0; pass < kNumPasses; pass++) {
+    int shift = pass * kDigitBits;
+    auto digit = [shift](const MortonPrimitive &m) {
+      return (size_t)((m.code >> shift) & (kNumDigits - 1));
+    };
+
+    std::fill(offsets.begin(), offsets.end(), 0);
+    parallel_chunks(v.size(), num_chunks, [&](size_t b, size_t e, size_t c) {
+      for (size_t i = b; i < e; i++) offsets[c * kNumDigits + digit(v[i])]++;
+    });
+
+    size_t sum = 0;
+    for (int d = 0; d < kNumDigits; d++) {
+      for (size_t c = 0; c < num_chunks; c++) {
+        size_t n = offsets[c * kNumDigits + d];
+        offsets[c * kNumDigits + d] = sum;
+        sum += n;
+      }
+    }
+
+    parallel_chunks(v.size(), num_chunks, [&](size_t b, size_t e, size_t c) {
+      for (size_t i = b; i < e; i++)
+        sorted[offsets[c * kNumDigits + digit(v[i])]++] = v[i];
+    });
+    v.swap(sorted);
+  }
+}
+
+BVHNode *BVHAccel::construct_lbvh(size_t max_leaf_size) {
+
+  size_t count = primitives.size();
+  if (count == 0) {
+    return construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+  }
+
+  size_t chunks = count >= kParallelBinSize ? num_threads : 1;
+
+  // Centroid bounds define the grid the Morton codes are computed on.
+  std::vector<BBox> cboxes(chunks);
+  parallel_chunks(count, chunks, [&](size_t b, size_t e, size_t c) {
+    for (size_t i = b; i < e; i++)
+      cboxes[c].expand(primitives[i]->get_bbox().centroid());
+  });
+  BBox cbox;
+  for (size_t c = 0; c < chunks; c++) cbox.expand(cboxes[c]);
+
+  Vector3D inv_extent;
+  for (int a = 0; a < 3; a++) {
+    inv_extent[a] = cbox.extent[a] > 0 ? 1.0 / cbox.extent[a] : 0.0;
+  }
+
+  std::vector<MortonPrimitive> morton(count);
+  parallel_chunks(count, chunks, [&](size_t b, size_t e, size_t c) {
+    for (size_t i = b; i < e; i++) {
+      Vector3D offset = primitives[i]->get_bbox().centroid() - cbox.min;
+      morton[i].code = morton_code(offset * inv_extent);
+      morton[i].p = primitives[i];
+    }
+  });
+
+  radix_sort(morton, chunks,
+             [this](size_t n, size_t num_chunks,
+                    const std::function<void(size_t, size_t, size_t)> &f) {
+               parallel_chunks(n, num_chunks, f);
+             });
+
+  std::vector<uint64_t> codes(count);
+  for (size_t i = 0; i < count; i++) {
+    primitives[i] = morton[i].p;
+    codes[i] = morton[i].code;
+  }
+
+  return emit_lbvh(codes, 0, count, 62, max_leaf_size);
+}
+
+BVHNode *BVHAccel::emit_lbvh(const std::vector<uint64_t> &codes, size_t start,
+                             size_t end, int bit, size_t max_leaf_size) {
+
+  size_t count = end - start;
+
+  // Skip the bits that every code in the range agrees on. Codes are sorted,
+  // so comparing the first and the last one is enough.
+  while (bit >= 0 && ((codes[start] ^ codes[end - 1]) >> bit & 1) == 0) {
+    bit--;
+  }
+
+  size_t mid = end;
+  if (count > max_leaf_size) {
+    if (bit < 0) {
+      // Identical codes, nothing left to split on but the count.
+      mid = start + count / 2;
     } else {
-        double x = bbox.extent.x;
-        double y = bbox.extent.y;
-        double z = bbox.extent.z;
-        double splitpoint;
-        int left_num = 0;
-        int right_num = 0;
-        BBox lbbox;
-        BBox rbbox;
-        BVHNode *left = new BVHNode(lbbox);
-        BVHNode *right = new BVHNode(rbbox);
-        auto p1 = start;
-        auto p2 = end - 1;
-        
-        if (x > y && x > z) {
-            splitpoint = bbox.min.x + (x / 2);
-//            cout << "splitpoint = " << splitpoint << endl;
-            while (p1 != p2) {
-                Vector3D p1_c = (*p1)->get_bbox().centroid();
-//                cout << "c.x = " << p1_c.x << endl;
-                if (p1_c.x > splitpoint) {
-//                    BBox bb = (*p1)->get_bbox();
-//                    rbbox.expand(bb);
-                    swap(*p1, *p2);
-                    p2 = p2 - 1;
-                    right_num += 1;
-                } else {
-    //                cout << "left" << endl;
-//                    BBox bb = (*p1)->get_bbox();
-//                    lbbox.expand(bb);
-                    left_num += 1;
-                    p1 = p1 + 1;
-                }
-            }
-            if ((*p1)->get_bbox().centroid().x < splitpoint) {
-                p1 = p1 + 1;
-            }
-        } else if (y > x && y > z) {
-            splitpoint = bbox.min.y + (y / 2);
-//            cout << "splitpoint = " << splitpoint << endl;
-            while (p1 != p2) {
-                Vector3D p1_c = (*p1)->get_bbox().centroid();
-//                cout << "c.y = " << p1_c.y << endl;
-                if (p1_c.y > splitpoint) {
-//                    BBox bb = (*p1)->get_bbox();
-//                    rbbox.expand(bb);
-                    swap(*p1, *p2);
-                    p2 = p2 - 1;
-                    right_num += 1;
-                } else {
-    //                cout << "left" << endl;
-//                    BBox bb = (*p1)->get_bbox();
-//                    lbbox.expand(bb);
-                    left_num += 1;
-                    p1 = p1 + 1;
-                }
-            }
-            if ((*p1)->get_bbox().centroid().y < splitpoint) {
-                p1 = p1 + 1;
-            }
-        } else {
-            splitpoint = bbox.min.z + (z / 2);
-//            cout << "splitpoint = " << splitpoint << endl;
-            while (p1 != p2) {
-                Vector3D p1_c = (*p1)->get_bbox().centroid();
-//                cout << "c.z = " << p1_c.z << endl;
-                if (p1_c.z > splitpoint) {
-//                    BBox bb = (*p1)->get_bbox();
-//                    rbbox.expand(bb);
-                    swap(*p1, *p2);
-                    p2 = p2 - 1;
-                    right_num += 1;
-                } else {
-        //               cout << "left" << endl;
-//                    BBox bb = (*p1)->get_bbox();
-//                    lbbox.expand(bb);
-                    left_num += 1;
-                    p1 = p1 + 1;
-                }
-            }
-            if ((*p1)->get_bbox().centroid().z < splitpoint) {
-                p1 = p1 + 1;
-                left_num += 1;
-            } else {right_num += 1;}
+      uint64_t mask = 1ull << bit;
+      mid = std::partition_point(codes.begin() + start, codes.begin() + end,
+                                 [mask](uint64_t code) {
+                                   return (code & mask) == 0;
+                                 }) - codes.begin();
+    }
+  }
+
+  if (mid == end) {
+    BBox bbox;
+    for (size_t i = start; i < end; i++) {
+      bbox.expand(primitives[i]->get_bbox());
+    }
+    BVHNode *node = new BVHNode(bbox);
+    node->start = primitives.begin() + start;
+    node->end = primitives.begin() + end;
+    return node;
+  }
+
+  BVHNode *l, *r;
+  if (count >= kParallelSubtreeSize && build_pool) {
+    ThreadPool::TaskGroup group;
+    build_pool->submit(group, [&]() {
+      l = emit_lbvh(codes, start, mid, bit - 1, max_leaf_size);
+    });
+    r = emit_lbvh(codes, mid, end, bit - 1, max_leaf_size);
+    build_pool->wait(group);
+  } else {
+    l = emit_lbvh(codes, start, mid, bit - 1, max_leaf_size);
+    r = emit_lbvh(codes, mid, end, bit - 1, max_leaf_size);
+  }
+
+  BBox bbox = l->bb;
+  bbox.expand(r->bb);
+  BVHNode *node = new BVHNode(bbox);
+  node->l = l;
+  node->r = r;
+  return node;
+}
+
+double BVHAccel::compute_sah_cost(const BVHNode *node) const {
+  double area = node->bb.surface_area();
+  if (node->isLeaf()) {
+    return cost_model.intersection_cost * (node->end - node->start) * area;
+  }
+  return cost_model.traversal_cost * area + compute_sah_cost(node->l) +
+         compute_sah_cost(node->r);
+}
+
+// Round a bound to single precision without shrinking the box.
+static inline float round_down(double x) {
+  float f = (float)x;
+  return (double)f > x ? std::nextafter(f, -INF_F) : f;
+}
+
+static inline float round_up(double x) {
+  float f = (float)x;
+  return (double)f < x ? std::nextafter(f, INF_F) : f;
+}
+
+static BVH4Node empty_wide_node() {
+  BVH4Node wide;
+  for (int c = 0; c < 4; c++) {
+    for (int a = 0; a < 3; a++) {
+      wide.min[a][c] = INF_F;
+      wide.max[a][c] = -INF_F;
+    }
+    wide.child[c] = 0;
+  }
+  wide.n_children = 0;
+  for (int k = 0; k < 3; k++) wide.pad[k] = 0;
+  return wide;
+}
+
+static void set_child_bounds(BVH4Node *wide, int c, const BBox &bb) {
+  for (int a = 0; a < 3; a++) {
+    wide->min[a][c] = round_down(bb.min[a]);
+    wide->max[a][c] = round_up(bb.max[a]);
+  }
+}
+
+void BVHAccel::build_wide_bvh() {
+
+  nodes.reserve(primitives.size() / 2 + 1);
+  leaves.reserve(primitives.size());
+  blocks.reserve(primitives.size() / 2 + 1);
+
+  coordinate_bound = 0;
+  for (int a = 0; a < 3; a++) {
+    coordinate_bound = std::max(coordinate_bound, round_up(fabs(root->bb.min[a])));
+    coordinate_bound = std::max(coordinate_bound, round_up(fabs(root->bb.max[a])));
+  }
+
+  if (root->isLeaf()) {
+    // Wrap a single leaf in a wide node so traversal always starts at one.
+    BVH4Node wide = empty_wide_node();
+    set_child_bounds(&wide, 0, root->bb);
+    wide.n_children = 1;
+    nodes.push_back(wide);
+    nodes[0].child[0] = collapse_bvh(root);
+  } else {
+    collapse_bvh(root);
+  }
+}
+
+int32_t BVHAccel::collapse_bvh(const BVHNode *node) {
+
+  if (node->isLeaf()) {
+    // Move the triangles to the front of the range and copy them into
+    // blocks; any other primitives stay behind them.
+    std::vector<Primitive *>::iterator start = primitives.begin() + (node->start - primitives.begin());
+    std::vector<Primitive *>::iterator end = primitives.begin() + (node->end - primitives.begin());
+    std::vector<Primitive *>::iterator others = std::stable_partition(start, end, [](Primitive *p) {
+      return dynamic_cast<Triangle *>(p) != NULL;
+    });
+
+    BVH4Leaf leaf;
+    leaf.prim_offset = start - primitives.begin();
+    leaf.n_primitives = end - start;
+    leaf.n_triangles = others - start;
+    leaf.block_offset = blocks.size();
+
+    for (uint32_t k = 0; k < leaf.n_triangles; k++) {
+      if (k % 4 == 0) blocks.push_back(BVH4TriangleBlock());
+      BVH4TriangleBlock &block = blocks.back();
+      PackedTriangle tri = static_cast<Triangle *>(*(start + k))->get_packed();
+      for (int a = 0; a < 3; a++) {
+        block.p0[a][k % 4] = tri.p0[a];
+        block.e1[a][k % 4] = tri.e1[a];
+        block.e2[a][k % 4] = tri.e2[a];
+      }
+    }
+
+    leaves.push_back(leaf);
+    return ~(int32_t)(leaves.size() - 1);
+  }
+
+  int32_t index = nodes.size();
+  nodes.push_back(BVH4Node());
+
+  // Open the largest interior child until the node has four children.
+  const BVHNode *children[4] = {node->l, node->r, NULL, NULL};
+  int n_children = 2;
+  while (n_children < 4) {
+    int largest = -1;
+    double largest_area = -1;
+    for (int c = 0; c < n_children; c++) {
+      if (children[c]->isLeaf()) continue;
+      double area = children[c]->bb.surface_area();
+      if (area > largest_area) {
+        largest = c;
+        largest_area = area;
+      }
+    }
+    if (largest < 0) break;
+    const BVHNode *opened = children[largest];
+    children[largest] = opened->l;
+    children[n_children++] = opened->r;
+  }
+
+  BVH4Node wide = empty_wide_node();
+  for (int c = 0; c < n_children; c++) {
+    set_child_bounds(&wide, c, children[c]->bb);
+    wide.child[c] = collapse_bvh(children[c]);
+  }
+  wide.n_children = n_children;
+
+  nodes[index] = wide;
+  return index;
+}
+
+float BVHAccel::triangle_tolerance(const Ray &ray) const {
+  float bound = coordinate_bound;
+  for (int a = 0; a < 3; a++) bound = std::max(bound, round_up(fabs(ray.o[a])));
+  return kTriangleTolerance * bound;
+}
+
+bool BVHAccel::has_intersection(const Ray &ray) const {
+
+  total_rays.fetch_add(1, std::memory_order_relaxed);
+  if (nodes.empty()) return false;
+
+  FloatRay fray(ray);
+  float t_min = round_down(ray.min_t);
+  float t_max = round_up(ray.max_t);
+  float tolerance = triangle_tolerance(ray);
+
+  // Any hit ends the query, so children are visited in storage order.
+  int32_t stack[kTraversalStackSize];
+  size_t top = 0;
+  stack[top++] = 0;
+  unsigned long long tests = 0;
+
+  while (top > 0) {
+    int32_t code = stack[--top];
+
+    if (code < 0) {
+      const BVH4Leaf &leaf = leaves[~code];
+      for (uint32_t k = 0; k < leaf.n_triangles; k += 4) {
+        uint32_t n = std::min<uint32_t>(4, leaf.n_triangles - k);
+        int mask = intersect_triangles(blocks[leaf.block_offset + k / 4], fray,
+                                       t_min, t_max, tolerance);
+        tests += n;
+        for (uint32_t lane = 0; lane < n; lane++) {
+          if (!(mask & (1 << lane))) continue;
+          const Triangle *tri = static_cast<const Triangle *>(primitives[leaf.prim_offset + k + lane]);
+          if (tri->Triangle::has_intersection(ray)) {
+            total_isects.fetch_add(tests, std::memory_order_relaxed);
+            return true;
+          }
         }
-        if (left_num == 0 || right_num == 0) {
-            p1 = start + floor(k/2);
+      }
+      for (uint32_t i = leaf.n_triangles; i < leaf.n_primitives; i++) {
+        tests++;
+        if (primitives[leaf.prim_offset + i]->has_intersection(ray)) {
+          total_isects.fetch_add(tests, std::memory_order_relaxed);
+          return true;
         }
-        
-//        cout << "left" << left_num << endl;
-//        cout << "right" << right_num << endl;
-        left = construct_bvh(start, p1, max_leaf_size);
-        right = construct_bvh(p1, end, max_leaf_size);
-        node->l = left;
-        node->r = right;
+      }
+      continue;
     }
-  return node;
+
+    const BVH4Node &node = nodes[code];
+    float t_entry[4];
+    int mask = intersect_node(node, fray, t_min, t_max, t_entry);
+    for (int c = 0; c < 4; c++) {
+      if (mask & (1 << c)) stack[top++] = node.child[c];
+    }
+  }
+
+  total_isects.fetch_add(tests, std::memory_order_relaxed);
+  return false;
 }
 
-bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-  // Take note that this function has a short-circuit that the
-  // Intersection version cannot, since it returns as soon as it finds
-  // a hit, it doesn't actually have to find the closest hit.
-    
-    double t0 = ray.min_t;
-    double t1 = ray.max_t;
-    if (node->bb.intersect(ray, t0, t1) == false) {
-        return false;
+bool BVHAccel::intersect_leaf(const BVH4Leaf &leaf, const Ray &ray,
+                              const FloatRay &fray, float t_min, float &t_max,
+                              float tolerance, Intersection *i) const {
+  bool hit = false;
+  for (uint32_t k = 0; k < leaf.n_triangles; k += 4) {
+    uint32_t n = std::min<uint32_t>(4, leaf.n_triangles - k);
+    int mask = intersect_triangles(blocks[leaf.block_offset + k / 4], fray,
+                                   t_min, t_max, tolerance);
+    // Candidates are confirmed by the exact test, which also shrinks
+    // ray.max_t so that farther candidates are rejected.
+    for (uint32_t lane = 0; lane < n; lane++) {
+      if (!(mask & (1 << lane))) continue;
+      const Triangle *tri = static_cast<const Triangle *>(primitives[leaf.prim_offset + k + lane]);
+      if (tri->Triangle::intersect(ray, i)) {
+        hit = true;
+        t_max = round_up(ray.max_t);
+      }
     }
-    if (t0 > ray.max_t || t1 < ray.min_t) {return false;}
-    if (node->isLeaf()) {
-        for (auto p = node->start; p != node->end; p++){
-            total_isects++;
-            if ((*p)->has_intersection(ray)) {return true;}
+  }
+  for (uint32_t p = leaf.n_triangles; p < leaf.n_primitives; p++) {
+    if (primitives[leaf.prim_offset + p]->intersect(ray, i)) {
+      hit = true;
+      t_max = round_up(ray.max_t);
+    }
+  }
+  return hit;
+}
+
+bool BVHAccel::intersect_subtree(const Ray &ray, Intersection *i,
+                                 int32_t code) const {
+
+  FloatRay fray(ray);
+  float t_min = round_down(ray.min_t);
+  float t_max = round_up(ray.max_t);
+  float tolerance = triangle_tolerance(ray);
+
+  // Entries keep the distance at which the ray enters the child, so that
+  // children pushed before a closer hit was found can be skipped.
+  struct StackEntry {
+    int32_t code;
+    float t;
+  };
+  StackEntry stack[kTraversalStackSize];
+  size_t top = 0;
+  stack[top].code = code;
+  stack[top++].t = t_min;
+  bool hit = false;
+  unsigned long long tests = 0;
+
+  while (top > 0) {
+    StackEntry entry = stack[--top];
+    if (entry.t > t_max) continue;
+
+    if (entry.code < 0) {
+      const BVH4Leaf &leaf = leaves[~entry.code];
+      hit = intersect_leaf(leaf, ray, fray, t_min, t_max, tolerance, i) || hit;
+      tests += leaf.n_primitives;
+      continue;
+    }
+
+    const BVH4Node &node = nodes[entry.code];
+    float t_entry[4];
+    int mask = intersect_node(node, fray, t_min, t_max, t_entry);
+
+    // Push the hit children far to near, so the nearest is visited next.
+    size_t first = top;
+    for (int c = 0; c < 4; c++) {
+      if (!(mask & (1 << c))) continue;
+      StackEntry child = {node.child[c], t_entry[c]};
+      size_t k = top++;
+      while (k > first && stack[k - 1].t < child.t) {
+        stack[k] = stack[k - 1];
+        k--;
+      }
+      stack[k] = child;
+    }
+  }
+
+  total_isects.fetch_add(tests, std::memory_order_relaxed);
+  return hit;
+}
+
+bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+
+  total_rays.fetch_add(1, std::memory_order_relaxed);
+  if (nodes.empty()) return false;
+
+  return intersect_subtree(ray, i, 0);
+}
+
+uint32_t BVHAccel::intersect_packet(const Ray *rays, Intersection *isects,
+                                    uint32_t active) const {
+
+  if (nodes.empty()) return 0;
+
+  FloatRay frays[kRayPacketSize];
+  float t_min[kRayPacketSize];
+  float t_max[kRayPacketSize];
+  float tolerance[kRayPacketSize];
+  unsigned long long rays_traced = 0, tests = 0;
+  for (size_t k = 0; k < kRayPacketSize; k++) {
+    if (!(active & (1u << k))) continue;
+    rays_traced++;
+    frays[k] = FloatRay(rays[k]);
+    t_min[k] = round_down(rays[k].min_t);
+    t_max[k] = round_up(rays[k].max_t);
+    tolerance[k] = triangle_tolerance(rays[k]);
+  }
+  if (!active) return 0;
+  total_rays.fetch_add(rays_traced, std::memory_order_relaxed);
+
+  // Entries carry the subset of the packet that reached the child.
+  struct StackEntry {
+    int32_t code;
+    uint32_t mask;
+  };
+  StackEntry stack[kTraversalStackSize];
+  size_t top = 0;
+  stack[top].code = 0;
+  stack[top++].mask = active;
+  uint32_t hits = 0;
+
+  while (top > 0) {
+    StackEntry entry = stack[--top];
+
+    // Once the packet has diverged to a single ray, sharing node fetches no
+    // longer pays for the bookkeeping; finish the subtree ray by ray.
+    if ((entry.mask & (entry.mask - 1)) == 0) {
+      uint32_t k = 0;
+      while (!(entry.mask & (1u << k))) k++;
+      if (intersect_subtree(rays[k], &isects[k], entry.code)) {
+        hits |= 1u << k;
+        t_max[k] = round_up(rays[k].max_t);
+      }
+      continue;
+    }
+
+    if (entry.code < 0) {
+      const BVH4Leaf &leaf = leaves[~entry.code];
+      for (uint32_t k = 0; k < kRayPacketSize; k++) {
+        if (!(entry.mask & (1u << k))) continue;
+        if (intersect_leaf(leaf, rays[k], frays[k], t_min[k], t_max[k],
+                           tolerance[k], &isects[k])) {
+          hits |= 1u << k;
         }
+        tests += leaf.n_primitives;
+      }
+      continue;
     }
-    bool intersect_left = has_intersection(ray, node->l);
-    bool intersect_right = has_intersection(ray, node->r);
-    return (intersect_left || intersect_right);
-//
-//  for (auto p : primitives) {
-//    total_isects++;
-//    if (p->has_intersection(ray))
-//      return true;
-//  }
-//  return false;
+
+    // Test every ray of the packet against the four children of the node.
+    const BVH4Node &node = nodes[entry.code];
+    uint32_t child_mask[4] = {0, 0, 0, 0};
+    float child_t[4] = {0, 0, 0, 0};
+    for (uint32_t k = 0; k < kRayPacketSize; k++) {
+      if (!(entry.mask & (1u << k))) continue;
+      float t_entry[4];
+      int mask = intersect_node(node, frays[k], t_min[k], t_max[k], t_entry);
+      for (int c = 0; c < 4; c++) {
+        if (!(mask & (1 << c))) continue;
+        child_mask[c] |= 1u << k;
+        child_t[c] += t_entry[c];
+      }
+    }
+
+    // Push the children far to near by the summed entry distance of the
+    // rays that hit them, which orders them by their mean for the packet.
+    int order[4];
+    int n_hit = 0;
+    for (int c = 0; c < 4; c++) {
+      if (!child_mask[c]) continue;
+      uint32_t n = 0;
+      for (uint32_t m = child_mask[c]; m; m &= m - 1) n++;
+      child_t[c] /= n;
+      int k = n_hit++;
+      while (k > 0 && child_t[order[k - 1]] < child_t[c]) {
+        order[k] = order[k - 1];
+        k--;
+      }
+      order[k] = c;
+    }
+    for (int k = 0; k < n_hit; k++) {
+      stack[top].code = node.child[order[k]];
+      stack[top++].mask = child_mask[order[k]];
+    }
+  }
+
+  total_isects.fetch_add(tests, std::memory_order_relaxed);
+  return hits;
+}
+
+bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
+  // Any-hit query: a shadow ray only needs to know that something blocks
+  // it, so return on the first primitive hit without searching further.
+
+  double t0 = ray.min_t;
+  double t1 = ray.max_t;
+  if (!node->bb.intersect(ray, t0, t1)) return false;
+  if (t0 > ray.max_t || t1 < ray.min_t) return false;
+
+  if (node->isLeaf()) {
+    for (auto p = node->start; p != node->end; p++) {
+      total_isects.fetch_add(1, std::memory_order_relaxed);
+      if ((*p)->has_intersection(ray)) return true;
+    }
+    return false;
+  }
+
+  return has_intersection(ray, node->l) || has_intersection(ray, node->r);
 }
 
 bool BVHAccel::intersect(const Ray &ray, Intersection *i, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-    
+  // Closest-hit query: every primitive hit shrinks ray.max_t, so visiting the
+  // nearer child first lets the box test cull the farther one.
+
+  double t0 = ray.min_t;
+  double t1 = ray.max_t;
+  if (!node->bb.intersect(ray, t0, t1)) return false;
+  if (t0 > ray.max_t || t1 < ray.min_t) return false;
+
+  if (node->isLeaf()) {
     bool hit = false;
-    double t0 = ray.min_t;
-    double t1 = ray.max_t;
-    if (node->bb.intersect(ray, t0, t1) == false) {
-        return hit;
-    }
-    if (t0 > ray.max_t || t1 < ray.min_t) {return hit;}
-    Intersection *nearest = i;
-    if (node->isLeaf()) {
-        for (auto p = node->start; p != node->end; p++){
-            total_isects++;
-            if ((*p)->intersect(ray, i)) {
-                hit = true;
-                if (i->t < nearest->t) {nearest = i;}
-            }
-        }
-        i = nearest;
-        return hit;
+    for (auto p = node->start; p != node->end; p++) {
+      total_isects.fetch_add(1, std::memory_order_relaxed);
+      hit = (*p)->intersect(ray, i) || hit;
     }
-    total_isects++;
-    Intersection *i_l = i;
-    Intersection *i_r = i;
-    bool intersect_left = intersect(ray, i_l, node->l);
-    bool intersect_right = intersect(ray, i_r, node->r);
-    if (i_l->t > i_r->t) {nearest = i_r;}
-    else {nearest = i_l;}
-    i = nearest;
-    return (intersect_left || intersect_right);
-    
-//  bool hit = false;
-//  for (auto p : primitives) {
-//    total_isects++;
-//    hit = p->intersect(ray, i) || hit;
-//  }
-//  return hit;
+    return hit;
+  }
+
+  BVHNode *first = node->l;
+  BVHNode *second = node->r;
+  if (dot(second->bb.centroid() - ray.o, ray.d) <
+      dot(first->bb.centroid() - ray.o, ray.d)) {
+    std::swap(first, second);
+  }
+
+  bool hit = intersect(ray, i, first);
+  return intersect(ray, i, second) || hit;
 }
 
 } // namespace SceneObjects
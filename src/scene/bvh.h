@@ -3,11 +3,40 @@
 
 #include "scene.h"
 #include "aggregate.h"
+#include "triangle.h"
 
+#include <atomic>
+#include <functional>
 #include <vector>
+#include <stdint.h>
+
+class ThreadPool;
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Strategy used to partition the primitives of an interior node when
+ * building the BVH.
+ */
+enum BVHSplitMethod {
+  BVH_SPLIT_MIDPOINT, ///< split at the midpoint of the longest axis
+  BVH_SPLIT_SAH,      ///< binned surface area heuristic
+  BVH_SPLIT_LBVH      ///< linear BVH, split on Morton code bits (fast build)
+};
+
+/**
+ * Cost model used by the surface area heuristic. Costs are relative, only
+ * the ratio between traversal and intersection matters when choosing splits,
+ * but the absolute values show up in the SAH cost reported for the tree.
+ */
+struct BVHCostModel {
+
+  BVHCostModel(double traversal_cost = 0.125, double intersection_cost = 1.0)
+    : traversal_cost(traversal_cost), intersection_cost(intersection_cost) { }
+
+  double traversal_cost;    ///< cost of visiting an interior node
+  double intersection_cost; ///< cost of a single ray - primitive test
+};
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -38,6 +67,53 @@ struct BVHNode {
   std::vector<Primitive*>::const_iterator end;
 };
 
+/**
+ * Maximum number of rays traced together by BVHAccel::intersect_packet.
+ */
+static const size_t kRayPacketSize = 16;
+
+/**
+ * A node of the 4-wide BVH used for traversal, built by collapsing the binary
+ * tree. The bounds of the children are stored as a structure of arrays, so
+ * that one ray can be tested against all four of them with a single SIMD slab
+ * test. Bounds are kept in single precision, rounded outwards. The children
+ * fill the first n_children slots; the slab test never reports the others.
+ */
+struct BVH4Node {
+
+  float min[3][4];     ///< min corners of the child boxes, by axis then child
+  float max[3][4];     ///< max corners of the child boxes, by axis then child
+  int32_t child[4];    ///< node index, or ~leaf index for leaf children
+  int32_t n_children;  ///< number of used child slots, 1 to 4
+  int32_t pad[3];
+};
+
+static_assert(sizeof(BVH4Node) == 128, "BVH4Node should be 128 bytes");
+
+/**
+ * A leaf of the 4-wide BVH, an index range into the primitive vector. The
+ * triangles of the leaf come first in the range and are also stored in
+ * consecutive triangle blocks; the remaining primitives are tested one by
+ * one.
+ */
+struct BVH4Leaf {
+  uint32_t prim_offset;   ///< index of the first primitive
+  uint32_t n_primitives;  ///< number of primitives
+  uint32_t n_triangles;   ///< number of triangles, at the start of the range
+  uint32_t block_offset;  ///< index of the first triangle block
+};
+
+/**
+ * Up to four triangles of a leaf in their single precision Moller-Trumbore
+ * layout, as a structure of arrays so that a ray is tested against all of
+ * them at once.
+ */
+struct BVH4TriangleBlock {
+  float p0[3][4];  ///< first vertices, by axis then triangle
+  float e1[3][4];  ///< edges from the first to the second vertex
+  float e2[3][4];  ///< edges from the first to the third vertex
+};
+
 /**
  * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
  * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -57,8 +133,15 @@ class BVHAccel : public Aggregate {
    * in memory for the aggregate to function properly.
    * \param primitives primitives to build from
    * \param max_leaf_size maximum number of primitives to be stored in leaves
+   * \param split_method strategy used to partition interior nodes
+   * \param cost_model relative costs used by the surface area heuristic
+   * \param pool threads the construction runs on as tasks, NULL to build on
+   *        the calling thread; must not be running a job
    */
-  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4,
+           BVHSplitMethod split_method = BVH_SPLIT_SAH,
+           const BVHCostModel& cost_model = BVHCostModel(),
+           ThreadPool* pool = NULL);
 
   /**
    * Destructor.
@@ -73,6 +156,13 @@ class BVHAccel : public Aggregate {
    */
   BBox get_bbox() const;
 
+  /**
+   * Get the SAH cost of the tree that was built, i.e. the expected cost of
+   * tracing a ray that hits the root bounding box under the cost model the
+   * aggregate was constructed with. Lower is better.
+   */
+  double get_sah_cost() const { return sah_cost; }
+
   /**
    * Ray - Aggregate intersection.
    * Check if the given ray intersects with the aggregate (any primitive in
@@ -81,10 +171,7 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool has_intersection(const Ray& r) const {
-    ++total_rays;
-    return has_intersection(r, root);
-  }
+  bool has_intersection(const Ray& r) const;
 
   bool has_intersection(const Ray& r, BVHNode *node) const;
 
@@ -101,13 +188,23 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool intersect(const Ray& r, Intersection* i) const {
-    ++total_rays;
-    return intersect(r, i, root);
-  }
+  bool intersect(const Ray& r, Intersection* i) const;
 
   bool intersect(const Ray& r, Intersection* i, BVHNode *node) const;
 
+  /**
+   * Ray packet - Aggregate intersection.
+   * Intersect up to kRayPacketSize coherent rays, such as the camera rays of
+   * neighbouring pixels, sharing node fetches between them. Rays diverging
+   * from the rest of the packet finish their traversal on their own.
+   * \param rays rays to test intersection with
+   * \param isects address to store intersection info, one per ray
+   * \param active mask of the rays to trace, bit k for rays[k]
+   * \return mask of the rays that intersect with the aggregate
+   */
+  uint32_t intersect_packet(const Ray* rays, Intersection* isects,
+                            uint32_t active) const;
+
   /**
    * Get BSDF of the surface material
    * Note that this does not make sense for the BVHAccel aggregate
@@ -133,12 +230,86 @@ class BVHAccel : public Aggregate {
   void drawOutline(const Color& c, float alpha) const { }
   void drawOutline(BVHNode *node, const Color& c, float alpha) const;
 
-  mutable unsigned long long total_rays, total_isects;
+  // Ray queries and primitive intersection tests since they were last reset,
+  // counted by every thread that traces rays. The padding keeps them off the
+  // cache lines of the tree data, which those threads only read.
+  char stats_pad0[64];
+  mutable std::atomic<unsigned long long> total_rays, total_isects;
+  char stats_pad1[64];
 
 private:
   std::vector<Primitive*> primitives;
-  BVHNode* root; ///< root node of the BVH
-  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size);
+  BVHNode* root; ///< root node of the BVH, kept for the visualizer
+  std::vector<BVH4Node> nodes;  ///< 4-wide BVH used for traversal
+  std::vector<BVH4Leaf> leaves; ///< leaves of the 4-wide BVH
+  std::vector<BVH4TriangleBlock> blocks; ///< triangles of the leaves
+  float coordinate_bound; ///< largest absolute coordinate in the scene
+
+  BVHSplitMethod split_method; ///< partitioning strategy used when building
+  BVHCostModel cost_model;     ///< costs used by the surface area heuristic
+  double sah_cost;             ///< SAH cost of the built tree
+
+  ThreadPool* build_pool;  ///< pool the construction runs on, while building
+  size_t num_threads;      ///< threads of the build pool, 1 without one
+
+  /**
+   * Split [0, n) into num_chunks contiguous pieces and run f(begin, end,
+   * chunk) on each, as tasks on the build pool of which the calling thread
+   * takes the last one, or one after the other without a pool.
+   */
+  void parallel_chunks(size_t n, size_t num_chunks,
+                       const std::function<void(size_t, size_t, size_t)>& f);
+
+  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size, size_t depth = 0);
+
+  /**
+   * Build a linear BVH: sort the primitives by the Morton code of their
+   * centroids, then emit the hierarchy by splitting each range where the
+   * highest differing code bit changes.
+   */
+  BVHNode *construct_lbvh(size_t max_leaf_size);
+  BVHNode *emit_lbvh(const std::vector<uint64_t>& codes, size_t start, size_t end, int bit, size_t max_leaf_size);
+
+  /**
+   * Partition [start, end) for an interior node. Returns the first primitive
+   * of the right child, or end if the range should become a leaf.
+   */
+  std::vector<Primitive*>::iterator split_midpoint(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, const BBox& bbox) const;
+  std::vector<Primitive*>::iterator split_sah(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, const BBox& bbox, const BBox& cbox, size_t max_leaf_size);
+
+  double compute_sah_cost(const BVHNode *node) const;
+
+  /**
+   * Fill the 4-wide nodes and leaves from the binary tree.
+   */
+  void build_wide_bvh();
+
+  /**
+   * Collapse the binary subtree at node into 4-wide nodes. Each wide node
+   * takes the four descendants left after repeatedly opening the interior
+   * child with the largest surface area. Returns the child code of the
+   * subtree: its node index, or ~leaf index if the node is a leaf.
+   */
+  int32_t collapse_bvh(const BVHNode *node);
+
+  /**
+   * Error scale for the single precision triangle prefilter, bounded by the
+   * magnitude of the ray origin and of the scene coordinates.
+   */
+  float triangle_tolerance(const Ray& ray) const;
+
+  /**
+   * Closest hit of a ray among the primitives of a leaf, clipped to the
+   * float range [t_min, t_max]. t_max follows ray.max_t as hits are found.
+   */
+  bool intersect_leaf(const BVH4Leaf& leaf, const Ray& ray, const FloatRay& fray,
+                      float t_min, float& t_max, float tolerance,
+                      Intersection* i) const;
+
+  /**
+   * Closest hit of a single ray in the subtree with the given child code.
+   */
+  bool intersect_subtree(const Ray& ray, Intersection* i, int32_t code) const;
 };
 
 } // namespace SceneObjects
@@ -0,0 +1,220 @@
+#ifndef CGL_BVH_KERNELS_H
+#define CGL_BVH_KERNELS_H
+
+#include "bvh.h"
+
+#include <cmath>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+namespace CGL { namespace SceneObjects {
+
+/*
+ * Single precision ray tests used by the BVH traversal. Every test is
+ * conservative: it may report a hit that the exact double precision test
+ * rejects, but never the other way around. With __AVX__ the tests run four
+ * lanes at once; the scalar versions are always available as a fallback and
+ * as a reference for the benchmarks.
+ */
+
+// Slack on the far slab distance of single precision node tests, covering
+// the rounding of the subtraction and multiplication (1 + 2 * gamma(3)).
+static const float kSlabRoundingScale = 1.0f + 4e-7f;
+
+// Relative error allowed for by the single precision triangle prefilter.
+// Far above the actual float rounding error; a wider margin only costs an
+// occasional extra double precision test.
+static const float kTriangleTolerance = 1e-4f;
+
+/**
+ * Slab test of a ray against the four children of a node, clipped to
+ * [t_min, t_max] so that children beyond the closest hit so far are culled.
+ * Returns a mask with bit c set if child c is hit, and stores the entry
+ * distance of every child in t_entry. Unused child slots are never set, even
+ * for rays whose NaN slab distances hit every box.
+ */
+inline int intersect_node_scalar(const BVH4Node &node, const FloatRay &r,
+                                 float t_min, float t_max, float t_entry[4]) {
+  int mask = 0;
+  for (int c = 0; c < 4; c++) {
+    float t0 = t_min;
+    float t1 = t_max;
+    for (int a = 0; a < 3; a++) {
+      float tnear = ((r.sign[a] ? node.max[a][c] : node.min[a][c]) - r.o[a]) * r.inv_d[a];
+      float tfar = ((r.sign[a] ? node.min[a][c] : node.max[a][c]) - r.o[a]) * r.inv_d[a];
+      tfar *= kSlabRoundingScale;
+      if (tnear > t0) t0 = tnear;
+      if (tfar < t1) t1 = tfar;
+    }
+    t_entry[c] = t0;
+    if (t0 <= t1) mask |= 1 << c;
+  }
+  return mask & ((1 << node.n_children) - 1);
+}
+
+inline int intersect_node(const BVH4Node &node, const FloatRay &r,
+                          float t_min, float t_max, float t_entry[4]) {
+#ifdef __AVX__
+  __m128 t0 = _mm_set1_ps(t_min);
+  __m128 t1 = _mm_set1_ps(t_max);
+  __m128 scale = _mm_set1_ps(kSlabRoundingScale);
+  for (int a = 0; a < 3; a++) {
+    __m128 o = _mm_set1_ps(r.o[a]);
+    __m128 inv_d = _mm_set1_ps(r.inv_d[a]);
+    __m128 near = _mm_loadu_ps(r.sign[a] ? node.max[a] : node.min[a]);
+    __m128 far = _mm_loadu_ps(r.sign[a] ? node.min[a] : node.max[a]);
+    __m128 tnear = _mm_mul_ps(_mm_sub_ps(near, o), inv_d);
+    __m128 tfar = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far, o), inv_d), scale);
+    // Keep the running bound when a slab distance is NaN (0 * inf).
+    t0 = _mm_max_ps(tnear, t0);
+    t1 = _mm_min_ps(tfar, t1);
+  }
+  _mm_storeu_ps(t_entry, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.n_children) - 1);
+#else
+  return intersect_node_scalar(node, r, t_min, t_max, t_entry);
+#endif
+}
+
+/**
+ * Moller-Trumbore test of a ray against the four triangles of a block.
+ * Returns a mask with bit k set unless triangle k is certain to be missed
+ * within [t_min, t_max]. Every bound is widened by an error estimate for the
+ * float arithmetic, and near-degenerate determinants are always reported, to
+ * be decided by the exact test.
+ * \param tolerance kTriangleTolerance times a bound on the magnitude of the
+ *        ray origin and the triangle coordinates
+ */
+inline int intersect_triangles_scalar(const BVH4TriangleBlock &b,
+                                      const FloatRay &r, float t_min,
+                                      float t_max, float tolerance) {
+  float d_norm = fabsf(r.d[0]) + fabsf(r.d[1]) + fabsf(r.d[2]);
+
+  int mask = 0;
+  for (int k = 0; k < 4; k++) {
+    float e1[3] = {b.e1[0][k], b.e1[1][k], b.e1[2][k]};
+    float e2[3] = {b.e2[0][k], b.e2[1][k], b.e2[2][k]};
+    float e1_norm = fabsf(e1[0]) + fabsf(e1[1]) + fabsf(e1[2]);
+    float e2_norm = fabsf(e2[0]) + fabsf(e2[1]) + fabsf(e2[2]);
+
+    float p[3] = {r.d[1] * e2[2] - r.d[2] * e2[1],
+                  r.d[2] * e2[0] - r.d[0] * e2[2],
+                  r.d[0] * e2[1] - r.d[1] * e2[0]};
+    float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    float det_error = kTriangleTolerance * d_norm * e1_norm * e2_norm;
+    if (fabsf(det) <= 2 * det_error) {
+      mask |= 1 << k;
+      continue;
+    }
+
+    float s[3] = {r.o[0] - b.p0[0][k], r.o[1] - b.p0[1][k],
+                  r.o[2] - b.p0[2][k]};
+    float q[3] = {s[1] * e1[2] - s[2] * e1[1],
+                  s[2] * e1[0] - s[0] * e1[2],
+                  s[0] * e1[1] - s[1] * e1[0]};
+
+    // Barycentrics and distance, all still scaled by the determinant.
+    float u = s[0] * p[0] + s[1] * p[1] + s[2] * p[2];
+    float v = r.d[0] * q[0] + r.d[1] * q[1] + r.d[2] * q[2];
+    float t = e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2];
+    if (det < 0) {
+      det = -det;
+      u = -u;
+      v = -v;
+      t = -t;
+    }
+
+    float u_error = tolerance * d_norm * e2_norm;
+    float v_error = tolerance * d_norm * e1_norm;
+    float t_error = tolerance * e1_norm * e2_norm;
+
+    if (u + u_error < 0 || v + v_error < 0) continue;
+    if (u + v - u_error - v_error > det + det_error) continue;
+    if (t + t_error < t_min * (det - det_error)) continue;
+    if (t - t_error > t_max * (det + det_error)) continue;
+    mask |= 1 << k;
+  }
+  return mask;
+}
+
+#ifdef __AVX__
+static inline __m128 abs_ps(__m128 x) {
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+}
+
+static inline __m128 cross_ps(__m128 ay, __m128 az, __m128 by, __m128 bz) {
+  return _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+}
+#endif
+
+inline int intersect_triangles(const BVH4TriangleBlock &b, const FloatRay &r,
+                               float t_min, float t_max, float tolerance) {
+#ifdef __AVX__
+  __m128 d[3], e1[3], e2[3], s[3];
+  for (int a = 0; a < 3; a++) {
+    d[a] = _mm_set1_ps(r.d[a]);
+    e1[a] = _mm_loadu_ps(b.e1[a]);
+    e2[a] = _mm_loadu_ps(b.e2[a]);
+    s[a] = _mm_sub_ps(_mm_set1_ps(r.o[a]), _mm_loadu_ps(b.p0[a]));
+  }
+  __m128 d_norm = _mm_set1_ps(fabsf(r.d[0]) + fabsf(r.d[1]) + fabsf(r.d[2]));
+  __m128 e1_norm = _mm_add_ps(_mm_add_ps(abs_ps(e1[0]), abs_ps(e1[1])), abs_ps(e1[2]));
+  __m128 e2_norm = _mm_add_ps(_mm_add_ps(abs_ps(e2[0]), abs_ps(e2[1])), abs_ps(e2[2]));
+
+  __m128 p[3] = {cross_ps(d[1], d[2], e2[1], e2[2]),
+                 cross_ps(d[2], d[0], e2[2], e2[0]),
+                 cross_ps(d[0], d[1], e2[0], e2[1])};
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p[0]), _mm_mul_ps(e1[1], p[1])),
+                          _mm_mul_ps(e1[2], p[2]));
+  __m128 det_error = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(kTriangleTolerance), d_norm),
+                                _mm_mul_ps(e1_norm, e2_norm));
+  __m128 degenerate = _mm_cmple_ps(abs_ps(det), _mm_add_ps(det_error, det_error));
+
+  __m128 q[3] = {cross_ps(s[1], s[2], e1[1], e1[2]),
+                 cross_ps(s[2], s[0], e1[2], e1[0]),
+                 cross_ps(s[0], s[1], e1[0], e1[1])};
+
+  // Barycentrics and distance, all still scaled by the determinant, with the
+  // sign of the determinant folded in.
+  __m128 sign = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+  det = _mm_xor_ps(det, sign);
+  __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], p[0]), _mm_mul_ps(s[1], p[1])),
+                        _mm_mul_ps(s[2], p[2]));
+  __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q[0]), _mm_mul_ps(d[1], q[1])),
+                        _mm_mul_ps(d[2], q[2]));
+  __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q[0]), _mm_mul_ps(e2[1], q[1])),
+                        _mm_mul_ps(e2[2], q[2]));
+  u = _mm_xor_ps(u, sign);
+  v = _mm_xor_ps(v, sign);
+  t = _mm_xor_ps(t, sign);
+
+  __m128 tol = _mm_set1_ps(tolerance);
+  __m128 u_error = _mm_mul_ps(_mm_mul_ps(tol, d_norm), e2_norm);
+  __m128 v_error = _mm_mul_ps(_mm_mul_ps(tol, d_norm), e1_norm);
+  __m128 t_error = _mm_mul_ps(_mm_mul_ps(tol, e1_norm), e2_norm);
+  __m128 zero = _mm_setzero_ps();
+
+  __m128 miss = _mm_or_ps(_mm_cmplt_ps(_mm_add_ps(u, u_error), zero),
+                          _mm_cmplt_ps(_mm_add_ps(v, v_error), zero));
+  miss = _mm_or_ps(miss, _mm_cmpgt_ps(
+      _mm_sub_ps(_mm_add_ps(u, v), _mm_add_ps(u_error, v_error)),
+      _mm_add_ps(det, det_error)));
+  miss = _mm_or_ps(miss, _mm_cmplt_ps(
+      _mm_add_ps(t, t_error),
+      _mm_mul_ps(_mm_set1_ps(t_min), _mm_sub_ps(det, det_error))));
+  miss = _mm_or_ps(miss, _mm_cmpgt_ps(
+      _mm_sub_ps(t, t_error),
+      _mm_mul_ps(_mm_set1_ps(t_max), _mm_add_ps(det, det_error))));
+
+  return (~_mm_movemask_ps(miss) & 0xf) | _mm_movemask_ps(degenerate);
+#else
+  return intersect_triangles_scalar(b, r, t_min, t_max, tolerance);
+#endif
+}
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_BVH_KERNELS_H
@@ -1,22 +1,219 @@
 #include "environment_light.h"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "util/random_util.h"
+
 namespace CGL { namespace SceneObjects {
 
+EnvironmentDistribution::EnvironmentDistribution(const HDRImageBuffer& map)
+    : w(map.w), h(map.h), func(w * h), marginal_cdf(h + 1),
+      conditional_cdf(h * (w + 1)) {
+
+  // Average of the bilinear lookup over each pixel: a [1 6 1] / 8 filter
+  // along each axis, wrapping around horizontally and clamped at the poles.
+  std::vector<double> rows(w * h);
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      double left = map.get_pixel((x + w - 1) % w, y).illum();
+      double right = map.get_pixel((x + 1) % w, y).illum();
+      rows[x + y * w] = (left + 6 * map.get_pixel(x, y).illum() + right) / 8;
+    }
+  }
+  double total = 0;
+  for (size_t y = 0; y < h; y++) {
+    const double* above = &rows[(y > 0 ? y - 1 : 0) * w];
+    const double* row = &rows[y * w];
+    const double* below = &rows[(y + 1 < h ? y + 1 : y) * w];
+    double sin_theta = sin(PI * (y + 0.5) / h);
+    for (size_t x = 0; x < w; x++) {
+      double f = (above[x] + 6 * row[x] + below[x]) / 8 * sin_theta;
+      func[x + y * w] = (float)std::max(f, 0.0);
+      total += func[x + y * w];
+    }
+  }
+  if (total <= 0) {
+    std::fill(func.begin(), func.end(), 1.0f);
+    total = (double)w * h;
+  }
+  integral = total / (w * h);
+
+  std::vector<double> row_sums(h);
+  for (size_t y = 0; y < h; y++) {
+    double sum = 0;
+    for (size_t x = 0; x < w; x++) sum += func[x + y * w];
+    row_sums[y] = sum;
+
+    // Rows without weight are never picked; give them a uniform CDF anyway.
+    float* cdf = &conditional_cdf[y * (w + 1)];
+    double running = 0;
+    cdf[0] = 0;
+    for (size_t x = 0; x < w; x++) {
+      running += sum > 0 ? func[x + y * w] : 1;
+      cdf[x + 1] = (float)(running / (sum > 0 ? sum : w));
+    }
+    cdf[w] = 1;
+  }
+
+  double running = 0;
+  marginal_cdf[0] = 0;
+  for (size_t y = 0; y < h; y++) {
+    running += row_sums[y];
+    marginal_cdf[y + 1] = (float)(running / total);
+  }
+  marginal_cdf[h] = 1;
+}
+
+/**
+ * Inverts the piecewise linear CDF of n bins at u, returning the bin the
+ * result falls in and the result, in [0, 1), in x.
+ */
+static size_t sample_cdf(const float* cdf, size_t n, double u, double* x) {
+  // The last bin whose CDF starts at or below u, skipping empty bins.
+  size_t i = std::upper_bound(cdf, cdf + n + 1, (float)u) - cdf;
+  i = std::min(std::max(i, (size_t)1), n) - 1;
+  while (i + 1 < n && cdf[i + 1] <= cdf[i]) i++;
+  double width = cdf[i + 1] - cdf[i];
+  double offset = width > 0 ? (u - cdf[i]) / width : 0.5;
+  *x = std::min((i + clamp(offset, 0.0, 1.0)) / n, 1 - 1e-7);
+  return i;
+}
+
+Vector2D EnvironmentDistribution::sample(const Vector2D& u, double* pdf) const {
+  Vector2D uv;
+  size_t y = sample_cdf(&marginal_cdf[0], h, u.y, &uv.y);
+  size_t x = sample_cdf(&conditional_cdf[y * (w + 1)], w, u.x, &uv.x);
+  *pdf = func[x + y * w] / integral;
+  return uv;
+}
+
+double EnvironmentDistribution::pdf(const Vector2D& uv) const {
+  size_t x = std::min((size_t)(uv.x * w), w - 1);
+  size_t y = std::min((size_t)(uv.y * h), h - 1);
+  return func[x + y * w] / integral;
+}
+
+/**
+ * Distribution of map, shared by all the lights built on the same buffer
+ * while any of them is alive, so that loading a scene again does not rebuild
+ * it. An entry is reused only for a buffer at the same address with the same
+ * size and contents, the latter compared by hash.
+ */
+static std::shared_ptr<const EnvironmentDistribution> distribution_of(
+    const HDRImageBuffer& map) {
+  struct Entry {
+    size_t w, h;
+    uint64_t hash;
+    std::weak_ptr<const EnvironmentDistribution> distribution;
+  };
+  static std::mutex lock;
+  static std::map<const HDRImageBuffer*, Entry> cache;
+
+  uint64_t hash = 0;
+  const uint32_t* words = reinterpret_cast<const uint32_t*>(map.data.data());
+  size_t num_words = map.data.size() * sizeof(map.data[0]) / sizeof(uint32_t);
+  for (size_t i = 0; i < num_words; i++) {
+    hash = splitmix64(hash ^ words[i]);
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (it->second.distribution.expired()) {
+      it = cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  Entry& entry = cache[&map];
+  std::shared_ptr<const EnvironmentDistribution> d = entry.distribution.lock();
+  if (!d || entry.w != map.w || entry.h != map.h || entry.hash != hash) {
+    d = std::make_shared<EnvironmentDistribution>(map);
+    entry.w = map.w;
+    entry.h = map.h;
+    entry.hash = hash;
+    entry.distribution = d;
+  }
+  return d;
+}
+
 EnvironmentLight::EnvironmentLight(const HDRImageBuffer* envMap)
-    : envMap(envMap) {
-  // TODO: initialize things here as needed
+    : envMap(envMap), distribution(distribution_of(*envMap)) {
+}
+
+// Map coordinates of the direction the map is seen in, and back: u turns
+// with the azimuth around +y, v runs from +y (0) down to -y (1).
+static Vector2D dir_to_uv(const Vector3D& d) {
+  double theta = acos(clamp(d.y, -1.0, 1.0));
+  double phi = atan2(d.z, -d.x);
+  if (phi < 0) phi += 2 * PI;
+  return Vector2D(phi / (2 * PI), theta / PI);
+}
+
+static Vector3D uv_to_dir(const Vector2D& uv) {
+  double theta = uv.y * PI;
+  double phi = uv.x * 2 * PI;
+  double sin_theta = sin(theta);
+  return Vector3D(-sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
 }
 
 Spectrum EnvironmentLight::sample_L(const Vector3D& p, Vector3D* wi,
-                                    float* distToLight,
-                                    float* pdf) const {
-  // TODO: Implement
-  return Spectrum(0, 0, 0);
+                                    float* distToLight, float* pdf,
+                                    SamplerState& rng) const {
+  double pdf_uv;
+  Vector2D uv = distribution->sample(sampler.get_sample(rng), &pdf_uv);
+  *wi = uv_to_dir(uv);
+  *distToLight = INF_D;
+
+  // (u, v) covers 2 pi^2 sin(theta) steradians per unit area.
+  double sin_theta = std::max(sin(uv.y * PI), 1e-8);
+  *pdf = pdf_uv / (2 * PI * PI * sin_theta);
+  return lookup(uv);
+}
+
+Spectrum EnvironmentLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                                  float* distToLight, float* pdf) const {
+  Vector2D uv = dir_to_uv(wi);
+  double sin_theta = std::max(sin(uv.y * PI), 1e-8);
+  *distToLight = INF_D;
+  *pdf = distribution->pdf(uv) / (2 * PI * PI * sin_theta);
+  return lookup(uv);
+}
+
+double EnvironmentLight::power(double scene_radius) const {
+  // Average radiance over the sphere; rows of the map shrink with sin(theta).
+  double sum = 0, weight = 0;
+  for (size_t y = 0; y < envMap->h; y++) {
+    double sin_theta = sin(PI * (y + 0.5) / envMap->h);
+    for (size_t x = 0; x < envMap->w; x++) {
+      sum += envMap->get_pixel(x, y).illum() * sin_theta;
+    }
+    weight += sin_theta * envMap->w;
+  }
+  double radiance = weight > 0 ? sum / weight : 0;
+  return 4 * PI * PI * scene_radius * scene_radius * radiance;
 }
 
 Spectrum EnvironmentLight::sample_dir(const Ray& r) const {
-  // TODO: Implement
-  return Spectrum(0, 0, 0);
+  return lookup(dir_to_uv(r.d.unit()));
+}
+
+Spectrum EnvironmentLight::lookup(const Vector2D& uv) const {
+  size_t w = envMap->w, h = envMap->h;
+  double x = uv.x * w - 0.5;
+  double y = clamp(uv.y * h - 0.5, 0.0, h - 1.0);
+  double fx = floor(x), fy = floor(y);
+  double tx = x - fx, ty = y - fy;
+  size_t x0 = ((long)fx % (long)w + w) % w;
+  size_t x1 = (x0 + 1) % w;
+  size_t y0 = (size_t)fy;
+  size_t y1 = std::min(y0 + 1, h - 1);
+  return (envMap->get_pixel(x0, y0) * (1 - tx) +
+          envMap->get_pixel(x1, y0) * tx) * (1 - ty) +
+         (envMap->get_pixel(x0, y1) * (1 - tx) +
+          envMap->get_pixel(x1, y1) * tx) * ty;
 }
 
 } // namespace SceneObjects
@@ -5,8 +5,41 @@
 #include "util/image.h"
 #include "scene.h"
 
+#include <memory>
+#include <vector>
+
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Piecewise constant distribution over the pixels of a lat-long environment
+ * map, in proportion to the illuminance each pixel sends to the scene: its
+ * average over the pixel of the bilinear lookup, times the sine of the
+ * row's polar angle for the solid angle it covers. A marginal CDF picks the
+ * row and the conditional CDF of the row the column, each by binary search.
+ */
+struct EnvironmentDistribution {
+
+  EnvironmentDistribution(const HDRImageBuffer& map);
+
+  /**
+   * Maps a point (u1, u2) of the unit square to map coordinates (u, v) in
+   * [0, 1)^2, distributed in proportion to the pixel weights.
+   * \param pdf density of the result with respect to area in (u, v)
+   */
+  Vector2D sample(const Vector2D& u, double* pdf) const;
+
+  /**
+   * Density of sample at map coordinates uv, with respect to area in (u, v).
+   */
+  double pdf(const Vector2D& uv) const;
+
+  size_t w, h;
+  std::vector<float> func;             ///< weight of each pixel
+  std::vector<float> marginal_cdf;     ///< CDF over the rows, h + 1 entries
+  std::vector<float> conditional_cdf;  ///< CDF over each row, h rows of w + 1
+  double integral;                     ///< mean pixel weight
+};
+
 // An environment light can be thought of as an infinitely big sphere centered
 // around your scene, radiating light on the scene in a pattern matching some
 // image. This is commonly used for low-cost renderings of complex backrounds or
@@ -16,34 +49,32 @@ class EnvironmentLight : public SceneLight {
  public:
   EnvironmentLight(const HDRImageBuffer* envMap);
   /**
-   * In addition to the work done by sample_dir, this function also has to
-   * choose a ray direction to sample along. You should initially use a uniform
-   * randomly distributed direction, but later you'll be required to implement
-   * this with importance sampling. The requirements are:
-   * - Sample within a pixel with probability proportional to the total power
-   *   going through that pixel (so proportional to the pixel's area when
-   *   projected onto the sphere, multiplied by the sum of the components of its
-   *   Spectrum). This is a discrete probability distribution, so there's no
-   *   formula.
-   * - Don't take linear time to generate a single sample! You'll be calling
-   *   this a LOT; it should be fast.
+   * Samples a direction towards the map in proportion to the illuminance it
+   * sends (see EnvironmentDistribution) and returns the radiance from it.
    */
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const { return false; }
   /**
-   * Returns the color found on the environment map by travelling in a specific
-   * direction. This entails:
-   * - Converting the 3-d ray direction into a 2-d image coordinate.
-   * - Performing bilinear interpolation to determine the color at the given
-   *   coordinate.
-   * - Handling the edge cases correctly (what happens if you wrap around the
-   *   environment map horizontally? What about vertically?).
+   * Radiance the map sends along -r.d, towards a ray that leaves the scene,
+   * bilinearly interpolated between pixels.
    */
   Spectrum sample_dir(const Ray& r) const;
 
  private:
+  /**
+   * Bilinearly filtered radiance at map coordinates uv, wrapping around
+   * horizontally and clamped at the poles.
+   */
+  Spectrum lookup(const Vector2D& uv) const;
+
   const HDRImageBuffer* envMap;
+  std::shared_ptr<const EnvironmentDistribution> distribution;
+  UniformGridSampler2D sampler;
 }; // class EnvironmentLight
 
 } // namespace SceneObjects
@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "pathtracer/sampler.h"
+#include "light_sampler.h"
 
 namespace CGL { namespace SceneObjects {
 
@@ -15,13 +16,28 @@ DirectionalLight::DirectionalLight(const Spectrum& rad,
 }
 
 Spectrum DirectionalLight::sample_L(const Vector3D& p, Vector3D* wi,
-                                    float* distToLight, float* pdf) const {
+                                    float* distToLight, float* pdf,
+                                    SamplerState& rng) const {
   *wi = dirToLight;
   *distToLight = INF_D;
   *pdf = 1.0;
   return radiance;
 }
 
+Spectrum DirectionalLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                                  float* distToLight, float* pdf) const {
+  *pdf = 0;
+  return Spectrum();
+}
+
+double DirectionalLight::power(double scene_radius) const {
+  return PI * scene_radius * scene_radius * radiance.illum();
+}
+
+bool DirectionalLight::bounds(LightBounds* bounds) const {
+  return false;
+}
+
 // Infinite Hemisphere Light //
 
 InfiniteHemisphereLight::InfiniteHemisphereLight(const Spectrum& rad)
@@ -32,15 +48,34 @@ InfiniteHemisphereLight::InfiniteHemisphereLight(const Spectrum& rad)
 }
 
 Spectrum InfiniteHemisphereLight::sample_L(const Vector3D& p, Vector3D* wi,
-                                           float* distToLight,
-                                           float* pdf) const {
-  Vector3D dir = sampler.get_sample();
+                                           float* distToLight, float* pdf,
+                                           SamplerState& rng) const {
+  Vector3D dir = sampler.get_sample(rng);
   *wi = sampleToWorld* dir;
   *distToLight = INF_D;
   *pdf = 1.0 / (2.0 * PI);
   return radiance;
 }
 
+Spectrum InfiniteHemisphereLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                                         float* distToLight, float* pdf) const {
+  if ((sampleToWorld.T() * wi).z <= 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+  *distToLight = INF_D;
+  *pdf = 1.0 / (2.0 * PI);
+  return radiance;
+}
+
+double InfiniteHemisphereLight::power(double scene_radius) const {
+  return 2 * PI * PI * scene_radius * scene_radius * radiance.illum();
+}
+
+bool InfiniteHemisphereLight::bounds(LightBounds* bounds) const {
+  return false;
+}
+
 // Point Light //
 
 PointLight::PointLight(const Spectrum& rad, const Vector3D& pos) : 
@@ -48,7 +83,7 @@ PointLight::PointLight(const Spectrum& rad, const Vector3D& pos) :
 
 Spectrum PointLight::sample_L(const Vector3D& p, Vector3D* wi,
                              float* distToLight,
-                             float* pdf) const {
+                             float* pdf, SamplerState& rng) const {
   Vector3D d = position - p;
   *wi = d.unit();
   *distToLight = d.norm();
@@ -56,6 +91,25 @@ Spectrum PointLight::sample_L(const Vector3D& p, Vector3D* wi,
   return radiance;
 }
 
+Spectrum PointLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                            float* distToLight, float* pdf) const {
+  *pdf = 0;
+  return Spectrum();
+}
+
+double PointLight::power(double scene_radius) const {
+  return 4 * PI * radiance.illum();
+}
+
+bool PointLight::bounds(LightBounds* bounds) const {
+  bounds->bb = BBox(position);
+  bounds->axis = Vector3D(0, 0, 1);
+  bounds->cos_theta_o = -1;
+  bounds->cos_theta_e = 0;
+  bounds->phi = power(0);
+  return true;
+}
+
 
 // Spot Light //
 
@@ -65,10 +119,26 @@ SpotLight::SpotLight(const Spectrum& rad, const Vector3D& pos,
 }
 
 Spectrum SpotLight::sample_L(const Vector3D& p, Vector3D* wi,
-                             float* distToLight, float* pdf) const {
+                             float* distToLight, float* pdf,
+                             SamplerState& rng) const {
   return Spectrum();
 }
 
+Spectrum SpotLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                           float* distToLight, float* pdf) const {
+  *pdf = 0;
+  return Spectrum();
+}
+
+double SpotLight::power(double scene_radius) const {
+  return 0;
+}
+
+bool SpotLight::bounds(LightBounds* bounds) const {
+  *bounds = LightBounds();
+  return true;
+}
+
 
 // Area Light //
 
@@ -79,19 +149,55 @@ AreaLight::AreaLight(const Spectrum& rad,
     dim_x(dim_x), dim_y(dim_y), area(dim_x.norm() * dim_y.norm()) { }
 
 Spectrum AreaLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                             float* distToLight, float* pdf) const {
+                             float* distToLight, float* pdf,
+                             SamplerState& rng) const {
 
-  Vector2D sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
+  Vector2D sample = sampler.get_sample(rng) - Vector2D(0.5f, 0.5f);
   Vector3D d = position + sample.x * dim_x + sample.y * dim_y - p;
-  float cosTheta = dot(d, direction);
   float sqDist = d.norm2();
   float dist = sqrt(sqDist);
+  float cosTheta = dot(d, direction) / dist;
   *wi = d / dist;
   *distToLight = dist;
   *pdf = sqDist / (area * fabs(cosTheta));
   return cosTheta < 0 ? radiance : Spectrum();
 };
 
+Spectrum AreaLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                           float* distToLight, float* pdf) const {
+  // Where wi crosses the plane of the light, from the side it emits to.
+  *pdf = 0;
+  double cosTheta = dot(wi, direction);
+  if (cosTheta >= 0) return Spectrum();
+  double t = dot(position - p, direction) / cosTheta;
+  if (t <= 0) return Spectrum();
+  Vector3D q = p + t * wi - position;
+  if (fabs(dot(q, dim_x)) > dim_x.norm2() / 2 ||
+      fabs(dot(q, dim_y)) > dim_y.norm2() / 2) {
+    return Spectrum();
+  }
+  *distToLight = t;
+  *pdf = t * t / (area * -cosTheta);
+  return radiance;
+}
+
+double AreaLight::power(double scene_radius) const {
+  return PI * area * radiance.illum();
+}
+
+bool AreaLight::bounds(LightBounds* bounds) const {
+  // Emits to the side direction points to.
+  bounds->bb = BBox(position - (dim_x + dim_y) / 2);
+  bounds->bb.expand(position + (dim_x - dim_y) / 2);
+  bounds->bb.expand(position + (dim_y - dim_x) / 2);
+  bounds->bb.expand(position + (dim_x + dim_y) / 2);
+  bounds->axis = direction;
+  bounds->cos_theta_o = 1;
+  bounds->cos_theta_e = 0;
+  bounds->phi = power(0);
+  return true;
+}
+
 
 // Sphere Light //
 
@@ -100,11 +206,27 @@ SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere) {
 }
 
 Spectrum SphereLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                               float* distToLight, float* pdf) const {
+                               float* distToLight, float* pdf,
+                               SamplerState& rng) const {
 
   return Spectrum();
 }
 
+Spectrum SphereLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                             float* distToLight, float* pdf) const {
+  *pdf = 0;
+  return Spectrum();
+}
+
+double SphereLight::power(double scene_radius) const {
+  return 0;
+}
+
+bool SphereLight::bounds(LightBounds* bounds) const {
+  *bounds = LightBounds();
+  return true;
+}
+
 // Mesh Light
 
 MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh) {
@@ -112,9 +234,25 @@ MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh) {
 }
 
 Spectrum MeshLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                             float* distToLight, float* pdf) const {
+                             float* distToLight, float* pdf,
+                             SamplerState& rng) const {
   return Spectrum();
 }
 
+Spectrum MeshLight::eval_L(const Vector3D& p, const Vector3D& wi,
+                           float* distToLight, float* pdf) const {
+  *pdf = 0;
+  return Spectrum();
+}
+
+double MeshLight::power(double scene_radius) const {
+  return 0;
+}
+
+bool MeshLight::bounds(LightBounds* bounds) const {
+  *bounds = LightBounds();
+  return true;
+}
+
 } // namespace SceneObjects
 } // namespace CGL
@@ -18,8 +18,12 @@ class DirectionalLight : public SceneLight {
  public:
   DirectionalLight(const Spectrum& rad, const Vector3D& lightDir);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -33,8 +37,12 @@ class InfiniteHemisphereLight : public SceneLight {
  public:
   InfiniteHemisphereLight(const Spectrum& rad);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -50,8 +58,12 @@ class PointLight : public SceneLight {
  public: 
   PointLight(const Spectrum& rad, const Vector3D& pos);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -66,8 +78,12 @@ class SpotLight : public SceneLight {
   SpotLight(const Spectrum& rad, const Vector3D& pos, 
             const Vector3D& dir, float angle);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -85,8 +101,12 @@ class AreaLight : public SceneLight {
             const Vector3D& pos,   const Vector3D& dir, 
             const Vector3D& dim_x, const Vector3D& dim_y);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -105,8 +125,12 @@ class SphereLight : public SceneLight {
  public:
   SphereLight(const Spectrum& rad, const SphereObject* sphere);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   const SphereObject* sphere;
@@ -121,8 +145,12 @@ class MeshLight : public SceneLight {
  public:
   MeshLight(const Spectrum& rad, const Mesh* mesh);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, SamplerState& rng) const;
+  Spectrum eval_L(const Vector3D& p, const Vector3D& wi, float* distToLight,
+                  float* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double scene_radius) const;
+  bool bounds(LightBounds* bounds) const;
 
  private:
   const Mesh* mesh;
@@ -0,0 +1,416 @@
+#include "light_sampler.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace CGL { namespace SceneObjects {
+
+// Largest double below 1, so that rescaled random numbers stay in [0, 1).
+static const double kOneMinusEpsilon =
+    1.0 - std::numeric_limits<double>::epsilon() / 2;
+
+// Buckets per axis the light BVH evaluates splits at.
+static const size_t kLightBuckets = 12;
+
+static inline double safe_sqrt(double x) {
+  return sqrt(std::max(0.0, x));
+}
+
+static inline double safe_acos(double x) {
+  return acos(std::min(1.0, std::max(-1.0, x)));
+}
+
+/**
+ * Rotates v by angle theta around the unit axis k (Rodrigues' formula).
+ */
+static inline Vector3D rotate(const Vector3D& v, const Vector3D& k,
+                              double theta) {
+  double c = cos(theta);
+  double s = sin(theta);
+  return v * c + cross(k, v) * s + k * (dot(k, v) * (1 - c));
+}
+
+void LightBounds::expand(const LightBounds& b) {
+  if (b.phi == 0) return;
+  if (phi == 0) {
+    *this = b;
+    return;
+  }
+
+  // Smallest cone around both normal cones.
+  double theta_a = safe_acos(cos_theta_o);
+  double theta_b = safe_acos(b.cos_theta_o);
+  double theta_d = safe_acos(dot(axis, b.axis));
+  if (std::min(theta_d + theta_a, PI) <= theta_b) {
+    axis = b.axis;
+    cos_theta_o = b.cos_theta_o;
+  } else if (std::min(theta_d + theta_b, PI) > theta_a) {
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    Vector3D w_r = cross(axis, b.axis);
+    if (theta_o >= PI || w_r.norm2() == 0) {
+      cos_theta_o = -1;
+    } else {
+      axis = rotate(axis, w_r.unit(), theta_o - theta_a);
+      cos_theta_o = cos(theta_o);
+    }
+  }
+
+  bb.expand(b.bb);
+  cos_theta_e = std::min(cos_theta_e, b.cos_theta_e);
+  phi += b.phi;
+}
+
+LightBVHNode::LightBVHNode(const LightBounds& b)
+    : radius((b.bb.extent / 2).norm()), cos_theta_o(b.cos_theta_o),
+      sin_theta_o(safe_sqrt(1 - b.cos_theta_o * b.cos_theta_o)),
+      cos_theta_e(b.cos_theta_e), phi(b.phi), parent(0), child(0),
+      leaf(false) {
+  Vector3D c = b.bb.centroid();
+  for (int i = 0; i < 3; i++) {
+    center[i] = c[i];
+    axis[i] = b.axis[i];
+  }
+}
+
+static inline float safe_sqrt(float x) {
+  return sqrtf(std::max(0.0f, x));
+}
+
+float LightBVHNode::importance(const Vector3D& p, const Vector3D& n) const {
+  float d[3] = {(float)p.x - center[0], (float)p.y - center[1],
+                (float)p.z - center[2]};
+  float dist2 = std::max(d[0] * d[0] + d[1] * d[1] + d[2] * d[2], 1e-12f);
+  float inv_dist = 1 / sqrtf(dist2);
+
+  // Half angle b the bounding sphere subtends from p, and the distance to
+  // its center, clamped to its radius so points inside do not blow up.
+  float cos_theta_b = -1, sin_theta_b = 0;
+  float inv_d2 = 1 / std::max(radius * radius, 1e-12f);
+  if (dist2 > radius * radius) {
+    sin_theta_b = radius * inv_dist;
+    cos_theta_b = safe_sqrt(1 - sin_theta_b * sin_theta_b);
+    inv_d2 = inv_dist * inv_dist;
+  }
+
+  // Smallest angle between the normal cone and the directions from the
+  // bounds towards p, cos(max(0, w - o - b)) for the angle w between the
+  // axis and the center; nothing reaches p beyond the emission angle. The
+  // sines are only needed where the differences are positive.
+  float cos_theta_p = 1;
+  float cos_theta_w =
+      (axis[0] * d[0] + axis[1] * d[1] + axis[2] * d[2]) * inv_dist;
+  if (cos_theta_w < cos_theta_o) {
+    float sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+    float cos_theta_x = cos_theta_w * cos_theta_o + sin_theta_w * sin_theta_o;
+    float sin_theta_x = sin_theta_w * cos_theta_o - cos_theta_w * sin_theta_o;
+    if (cos_theta_x < cos_theta_b) {
+      cos_theta_p = cos_theta_x * cos_theta_b + sin_theta_x * sin_theta_b;
+    }
+  }
+  if (cos_theta_p <= cos_theta_e) return 0;
+
+  // Smallest angle of incidence at p, cos(max(0, i - b)).
+  float cos_theta_pi = 1;
+  float cos_theta_i =
+      fabsf((float)n.x * d[0] + (float)n.y * d[1] + (float)n.z * d[2]) *
+      inv_dist;
+  if (cos_theta_i < cos_theta_b) {
+    float sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+    cos_theta_pi = cos_theta_i * cos_theta_b + sin_theta_i * sin_theta_b;
+  }
+
+  return std::max(0.0f, phi * cos_theta_p * cos_theta_pi * inv_d2);
+}
+
+// Power Light Sampler //
+
+PowerLightSampler::PowerLightSampler(const std::vector<SceneLight*>& lights,
+                                     double scene_radius)
+    : lights(lights.begin(), lights.end()), bins(lights.size()) {
+  size_t n = lights.size();
+  if (n == 0) return;
+
+  std::vector<double> weight(n);
+  double total = 0;
+  for (size_t i = 0; i < n; i++) {
+    weight[i] = std::max(0.0, lights[i]->power(scene_radius));
+    total += weight[i];
+  }
+  if (total == 0) {
+    weight.assign(n, 1);
+    total = n;
+  }
+
+  // Fill every bin up to the average weight with one light that is short of
+  // it and the rest from one that is over.
+  std::vector<double> q(n);
+  std::vector<size_t> small, large;
+  for (size_t i = 0; i < n; i++) {
+    bins[i].pmf = weight[i] / total;
+    q[i] = bins[i].pmf * n;
+    (q[i] < 1 ? small : large).push_back(i);
+    index[lights[i]] = i;
+  }
+  while (!small.empty() && !large.empty()) {
+    size_t s = small.back(); small.pop_back();
+    size_t l = large.back(); large.pop_back();
+    bins[s].q = q[s];
+    bins[s].alias = l;
+    q[l] += q[s] - 1;
+    (q[l] < 1 ? small : large).push_back(l);
+  }
+  // Whatever is left is full, up to rounding.
+  for (size_t i = 0; i < small.size(); i++) {
+    bins[small[i]].q = 1;
+    bins[small[i]].alias = small[i];
+  }
+  for (size_t i = 0; i < large.size(); i++) {
+    bins[large[i]].q = 1;
+    bins[large[i]].alias = large[i];
+  }
+}
+
+const SceneLight* PowerLightSampler::sample(const Vector3D& p,
+                                            const Vector3D& n,
+                                            SamplerState& rng,
+                                            double* pmf) const {
+  if (bins.empty()) return NULL;
+  double u = random_uniform(rng) * bins.size();
+  size_t i = std::min((size_t)u, bins.size() - 1);
+  if (u - i >= bins[i].q) i = bins[i].alias;
+  *pmf = bins[i].pmf;
+  return lights[i];
+}
+
+double PowerLightSampler::pmf(const Vector3D& p, const Vector3D& n,
+                              const SceneLight* light) const {
+  std::unordered_map<const SceneLight*, size_t>::const_iterator it =
+      index.find(light);
+  return it == index.end() ? 0 : bins[it->second].pmf;
+}
+
+// Light BVH //
+
+/**
+ * Surface area of bb, also for flat boxes.
+ */
+static double area(const BBox& bb) {
+  const Vector3D& e = bb.extent;
+  return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+/**
+ * Cost of a light BVH node with bounds b, split from a node with bounding
+ * box parent along axis: the power times the solid angle measure of the
+ * emission directions times the surface area, with the area of long thin
+ * boxes along axis raised (the SAOH of Conty Estevez and Kulla).
+ */
+static double light_cost(const LightBounds& b, const BBox& parent, int axis) {
+  double theta_o = safe_acos(b.cos_theta_o);
+  double theta_e = safe_acos(b.cos_theta_e);
+  double theta_w = std::min(theta_o + theta_e, PI);
+  double sin_theta_o = sin(theta_o);
+  double m_omega = 2 * PI * (1 - b.cos_theta_o) +
+                   PI / 2 * (2 * theta_w * sin_theta_o
+                             - cos(theta_o - 2 * theta_w)
+                             - 2 * theta_o * sin_theta_o + b.cos_theta_o);
+  const Vector3D& e = parent.extent;
+  double k_r = std::max(e.x, std::max(e.y, e.z)) / e[axis];
+  return b.phi * m_omega * k_r * area(b.bb);
+}
+
+LightBVH::LightBVH(const std::vector<SceneLight*>& lights) {
+  std::vector<BuildLight> build_lights;
+  for (size_t i = 0; i < lights.size(); i++) {
+    BuildLight l;
+    if (!lights[i]->bounds(&l.bounds)) {
+      infinite_lights.push_back(lights[i]);
+    } else if (l.bounds.phi > 0) {
+      // Lights that emit nothing are never picked.
+      l.light = bounded_lights.size();
+      bounded_lights.push_back(lights[i]);
+      build_lights.push_back(l);
+    }
+  }
+
+  if (!build_lights.empty()) {
+    nodes.reserve(2 * build_lights.size() - 1);
+    build(build_lights.begin(), build_lights.end(), 0);
+  }
+}
+
+uint32_t LightBVH::build(std::vector<BuildLight>::iterator start,
+                         std::vector<BuildLight>::iterator end,
+                         uint32_t parent) {
+  uint32_t index = nodes.size();
+
+  if (end - start == 1) {
+    nodes.push_back(LightBVHNode(start->bounds));
+    nodes[index].parent = parent;
+    nodes[index].child = start->light;
+    nodes[index].leaf = true;
+    leaf[bounded_lights[start->light]] = index;
+    return index;
+  }
+
+  LightBounds bounds;
+  BBox cbox;
+  for (std::vector<BuildLight>::iterator it = start; it != end; it++) {
+    bounds.expand(it->bounds);
+    cbox.expand(it->bounds.bb.centroid());
+  }
+
+  // Split between the buckets of centroids with the lowest cost, along any
+  // axis; halve the lights if all centroids coincide.
+  double best_cost = INF_D;
+  int best_axis = -1;
+  size_t best_split = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    if (cbox.extent[axis] <= 0) continue;
+
+    LightBounds buckets[kLightBuckets];
+    size_t counts[kLightBuckets] = {0};
+    for (std::vector<BuildLight>::iterator it = start; it != end; it++) {
+      double c = it->bounds.bb.centroid()[axis];
+      size_t b = std::min(kLightBuckets - 1, (size_t)(kLightBuckets *
+                 (c - cbox.min[axis]) / cbox.extent[axis]));
+      buckets[b].expand(it->bounds);
+      counts[b]++;
+    }
+
+    for (size_t split = 1; split < kLightBuckets; split++) {
+      LightBounds below, above;
+      size_t count_below = 0, count_above = 0;
+      for (size_t b = 0; b < split; b++) {
+        below.expand(buckets[b]);
+        count_below += counts[b];
+      }
+      for (size_t b = split; b < kLightBuckets; b++) {
+        above.expand(buckets[b]);
+        count_above += counts[b];
+      }
+      if (count_below == 0 || count_above == 0) continue;
+
+      double cost = light_cost(below, bounds.bb, axis) +
+                    light_cost(above, bounds.bb, axis);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = split;
+      }
+    }
+  }
+
+  std::vector<BuildLight>::iterator mid = start + (end - start) / 2;
+  if (best_axis >= 0) {
+    const BBox& c = cbox;
+    int axis = best_axis;
+    size_t split = best_split;
+    mid = std::partition(start, end, [&c, axis, split](const BuildLight& l) {
+      double x = l.bounds.bb.centroid()[axis];
+      size_t b = std::min(kLightBuckets - 1, (size_t)(kLightBuckets *
+                 (x - c.min[axis]) / c.extent[axis]));
+      return b < split;
+    });
+  }
+
+  nodes.push_back(LightBVHNode(bounds));
+  nodes[index].parent = parent;
+  build(start, mid, index);
+  uint32_t second = build(mid, end, index);
+  nodes[index].child = second;
+  return index;
+}
+
+const SceneLight* LightBVH::sample(const Vector3D& p, const Vector3D& n,
+                                   SamplerState& rng, double* pmf) const {
+  size_t num_infinite = infinite_lights.size();
+  size_t num_choices = num_infinite + (nodes.empty() ? 0 : 1);
+  if (num_choices == 0) return NULL;
+
+  // Lights at infinity each count as much as all bounded lights together.
+  double u = random_uniform(rng);
+  double p_infinite = (double)num_infinite / num_choices;
+  if (u < p_infinite) {
+    size_t i = std::min((size_t)(u * num_choices), num_infinite - 1);
+    *pmf = 1.0 / num_choices;
+    return infinite_lights[i];
+  }
+  u = std::min((u - p_infinite) / (1 - p_infinite), kOneMinusEpsilon);
+
+  // Walk down, reusing what is left of u at each level.
+  double prob = 1 - p_infinite;
+  uint32_t i = 0;
+  while (!nodes[i].leaf) {
+    uint32_t first = i + 1;
+    uint32_t second = nodes[i].child;
+    float importance_first = nodes[first].importance(p, n);
+    float importance_second = nodes[second].importance(p, n);
+    if (importance_first == 0 && importance_second == 0) return NULL;
+
+    // Probabilities as pmf computes them, so the two agree exactly.
+    float sum = importance_first + importance_second;
+    double p_first = importance_first / sum;
+    double p_second = importance_second / sum;
+    if (u < p_first) {
+      i = first;
+      u = std::min(u / p_first, kOneMinusEpsilon);
+      prob *= p_first;
+    } else {
+      i = second;
+      u = std::min((u - p_first) / p_second, kOneMinusEpsilon);
+      prob *= p_second;
+    }
+  }
+
+  // A lone light is only worth a shadow ray if it can reach p.
+  if (i == 0 && nodes[0].importance(p, n) == 0) return NULL;
+  *pmf = prob;
+  return bounded_lights[nodes[i].child];
+}
+
+double LightBVH::pmf(const Vector3D& p, const Vector3D& n,
+                     const SceneLight* light) const {
+  size_t num_infinite = infinite_lights.size();
+  size_t num_choices = num_infinite + (nodes.empty() ? 0 : 1);
+
+  std::unordered_map<const SceneLight*, uint32_t>::const_iterator it =
+      leaf.find(light);
+  if (it == leaf.end()) {
+    bool infinite = std::find(infinite_lights.begin(), infinite_lights.end(),
+                              light) != infinite_lights.end();
+    return infinite ? 1.0 / num_choices : 0;
+  }
+
+  // Walk up from the light's leaf, with the choices sample makes on the way.
+  double prob = 1 - (double)num_infinite / num_choices;
+  uint32_t i = it->second;
+  if (i == 0) return nodes[0].importance(p, n) > 0 ? prob : 0;
+  while (i != 0) {
+    uint32_t parent = nodes[i].parent;
+    float importance_first = nodes[parent + 1].importance(p, n);
+    float importance_second = nodes[nodes[parent].child].importance(p, n);
+    float importance = i == parent + 1 ? importance_first : importance_second;
+    if (importance == 0) return 0;
+    float sum = importance_first + importance_second;
+    prob *= (double)(importance / sum);
+    i = parent;
+  }
+  return prob;
+}
+
+LightSampler* make_light_sampler(LightSelection selection,
+                                 const std::vector<SceneLight*>& lights,
+                                 const BBox& scene_bounds) {
+  switch (selection) {
+    case LIGHT_SELECT_POWER:
+      return new PowerLightSampler(lights, scene_bounds.extent.norm() / 2);
+    case LIGHT_SELECT_BVH:
+      return new LightBVH(lights);
+    default:
+      return NULL;
+  }
+}
+
+} // namespace SceneObjects
+} // namespace CGL
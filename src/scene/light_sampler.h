@@ -0,0 +1,169 @@
+#ifndef CGL_LIGHT_SAMPLER_H
+#define CGL_LIGHT_SAMPLER_H
+
+#include "scene.h"
+#include "bbox.h"
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * How direct lighting chooses the lights it samples.
+ */
+enum LightSelection {
+  LIGHT_SELECT_ALL,   ///< sample every light at every shading point
+  LIGHT_SELECT_POWER, ///< pick lights in proportion to their power
+  LIGHT_SELECT_BVH    ///< pick lights by their importance to the point
+};
+
+/**
+ * Conservative description of the light a set of emitters sends out: the
+ * points it leaves from, a cone bounding the emitters' normals, the angle
+ * beyond those normals it is emitted to, and its power (Conty Estevez and
+ * Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+ * 2018).
+ */
+struct LightBounds {
+
+  LightBounds() : cos_theta_o(1), cos_theta_e(1), phi(0) { }
+
+  BBox bb;             ///< bounds of the emitting points
+  Vector3D axis;       ///< axis of the normal cone
+  double cos_theta_o;  ///< cosine of the half angle of the normal cone
+  double cos_theta_e;  ///< cosine of the emission angle around the normals
+  double phi;          ///< power, as for SceneLight::power
+
+  /**
+   * Expands the bounds to also bound the light of b.
+   */
+  void expand(const LightBounds& b);
+};
+
+/**
+ * Chooses one of the lights of a scene to sample at a shading point. The
+ * probability of choosing each light is known, so that the light sample is
+ * divided by it to keep direct lighting unbiased.
+ */
+class LightSampler {
+ public:
+  virtual ~LightSampler() { }
+
+  /**
+   * Picks a light to sample at point p with normal n.
+   * \param pmf probability with which the light was picked
+   * \return the light, NULL if none can light p
+   */
+  virtual const SceneLight* sample(const Vector3D& p, const Vector3D& n,
+                                   SamplerState& rng, double* pmf) const = 0;
+
+  /**
+   * Probability that sample picks light at point p with normal n.
+   */
+  virtual double pmf(const Vector3D& p, const Vector3D& n,
+                     const SceneLight* light) const = 0;
+};
+
+/**
+ * Picks lights in proportion to their power, in constant time with an alias
+ * table (Vose, "A Linear Algorithm for Generating Random Numbers with a
+ * Given Distribution", 1991). Ignores where the shading point is, so it
+ * suits scenes whose lights are all about as close to everything.
+ */
+class PowerLightSampler : public LightSampler {
+ public:
+  PowerLightSampler(const std::vector<SceneLight*>& lights,
+                    double scene_radius);
+
+  const SceneLight* sample(const Vector3D& p, const Vector3D& n,
+                           SamplerState& rng, double* pmf) const;
+  double pmf(const Vector3D& p, const Vector3D& n,
+             const SceneLight* light) const;
+
+ private:
+  struct Bin {
+    double q;       ///< probability of keeping the bin's own light
+    double pmf;     ///< probability of picking the bin's own light
+    size_t alias;   ///< light picked otherwise
+  };
+
+  std::vector<const SceneLight*> lights;
+  std::vector<Bin> bins;
+  std::unordered_map<const SceneLight*, size_t> index;
+};
+
+/**
+ * A node of a LightBVH, holding the LightBounds of its lights in the form
+ * importance evaluates fastest: in single precision, with the bounding sphere
+ * of the box and the sine of the cone angle. Interior nodes have two
+ * children, the first right after the node and the second at child; leaves
+ * hold one light.
+ */
+struct LightBVHNode {
+
+  LightBVHNode(const LightBounds& b);
+
+  /**
+   * Upper bound on the light received by a point p with normal n, up to a
+   * common factor; 0 only if none of the node's light can reach p.
+   */
+  float importance(const Vector3D& p, const Vector3D& n) const;
+
+  float center[3];     ///< center of the bounding sphere of the emitters
+  float axis[3];       ///< axis of the normal cone
+  float radius;        ///< radius of the bounding sphere
+  float cos_theta_o;   ///< cosine of the half angle of the normal cone
+  float sin_theta_o;   ///< sine of the half angle of the normal cone
+  float cos_theta_e;   ///< cosine of the emission angle around the normals
+  float phi;           ///< power
+  uint32_t parent;     ///< index of the parent node, itself for the root
+  uint32_t child;      ///< index of the second child, or of the light of a leaf
+  bool leaf;
+};
+
+/**
+ * Picks lights by walking down a BVH of their LightBounds, choosing each
+ * child in proportion to its importance to the shading point, so a light is
+ * picked in time logarithmic in the number of lights and mostly among the
+ * lights that are close, bright and facing the point. Lights at infinity
+ * have no bounds; they are picked uniformly, with the probability of one
+ * more light.
+ */
+class LightBVH : public LightSampler {
+ public:
+  LightBVH(const std::vector<SceneLight*>& lights);
+
+  const SceneLight* sample(const Vector3D& p, const Vector3D& n,
+                           SamplerState& rng, double* pmf) const;
+  double pmf(const Vector3D& p, const Vector3D& n,
+             const SceneLight* light) const;
+
+ private:
+  struct BuildLight {
+    size_t light;
+    LightBounds bounds;
+  };
+
+  uint32_t build(std::vector<BuildLight>::iterator start,
+                 std::vector<BuildLight>::iterator end, uint32_t parent);
+
+  std::vector<const SceneLight*> bounded_lights;
+  std::vector<const SceneLight*> infinite_lights;
+  std::vector<LightBVHNode> nodes;
+  std::unordered_map<const SceneLight*, uint32_t> leaf;  ///< node of a light
+};
+
+/**
+ * Creates the light sampler of the given selection method for lights, NULL
+ * for LIGHT_SELECT_ALL. scene_bounds scale the power of lights at infinity.
+ */
+LightSampler* make_light_sampler(LightSelection selection,
+                                 const std::vector<SceneLight*>& lights,
+                                 const BBox& scene_bounds);
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_LIGHT_SAMPLER_H
@@ -3,11 +3,14 @@
 
 #include "CGL/CGL.h"
 #include "primitive.h"
+#include "util/random_util.h"
 
 #include <vector>
 
 namespace CGL { namespace SceneObjects {
 
+struct LightBounds;
+
 /**
  * Interface for objects in the scene.
  */
@@ -35,9 +38,33 @@ class SceneObject {
 class SceneLight {
  public:
   virtual Spectrum sample_L(const Vector3D& p, Vector3D* wi,
-                            float* distToLight, float* pdf) const = 0;
+                            float* distToLight, float* pdf,
+                            SamplerState& rng) const = 0;
   virtual bool is_delta_light() const = 0;
 
+  /**
+   * Radiance the light sends to p from direction wi, as sample_L returns it
+   * for a sample in that direction, with the distance to the light and the
+   * pdf with which sample_L samples wi. Where the light does not cover wi,
+   * and always for delta lights, returns black with pdf 0.
+   */
+  virtual Spectrum eval_L(const Vector3D& p, const Vector3D& wi,
+                          float* distToLight, float* pdf) const = 0;
+
+  /**
+   * Power emitted by the light, as the illuminance of its flux, used to
+   * choose between lights. Lights at infinity count the flux through a disk
+   * of radius scene_radius facing them.
+   */
+  virtual double power(double scene_radius) const = 0;
+
+  /**
+   * Bounds of the emitting points, emission directions and power of the
+   * light, used to choose between lights by their importance to a point.
+   * \return false for lights at infinity, which have no such bounds
+   */
+  virtual bool bounds(LightBounds* bounds) const = 0;
+
 };
 
 
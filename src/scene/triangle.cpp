@@ -22,35 +22,53 @@ Triangle::Triangle(const Mesh *mesh, size_t v1, size_t v2, size_t v3) {
 
 BBox Triangle::get_bbox() const { return bbox; }
 
+PackedTriangle Triangle::get_packed() const {
+  PackedTriangle packed;
+  Vector3D e1 = p2 - p1;
+  Vector3D e2 = p3 - p1;
+  for (int a = 0; a < 3; a++) {
+    packed.p0[a] = (float)p1[a];
+    packed.e1[a] = (float)e1[a];
+    packed.e2[a] = (float)e2[a];
+  }
+  return packed;
+}
 
-bool Triangle::has_intersection(const Ray &r) const {
-  // Part 1, Task 3: implement ray-triangle intersection
-  // The difference between this function and the next function is that the next
-  // function records the "intersection" while this function only tests whether
-  // there is a intersection.
 
-    Vector3D origin = r.o;
-    Vector3D direction = r.d;
+bool Triangle::test(const Ray &r, double &t, double &b2, double &b3) const {
+  // Moller-Trumbore: solve o + t d = (1 - b2 - b3) p1 + b2 p2 + b3 p3.
+
     Vector3D e2 = p2 - p1;
     Vector3D e3 = p3 - p1;
 
-    Vector3D s = origin - p1;
-    Vector3D s2 = cross(direction, e3);
+    Vector3D s = r.o - p1;
+    Vector3D s2 = cross(r.d, e3);
     Vector3D s3 = cross(s, e2);
-        
-    double t = dot(s3, e3) / dot(s2, e2);
-    double b2 = dot(s2, s) / dot(s2, e2);
-    double b3 = dot(s3, direction) / dot(s2, e2);
+
+    t = dot(s3, e3) / dot(s2, e2);
+    b2 = dot(s2, s) / dot(s2, e2);
+    b3 = dot(s3, r.d) / dot(s2, e2);
     double b1 = 1 - b2 - b3;
-        
+
     if (b1 >= 1 || b1 <= 0) {return false;}
     if (b2 >= 1 || b2 <= 0) {return false;}
     if (b3 >= 1 || b3 <= 0) {return false;}
     if (t > r.max_t || t < r.min_t) {return false;}
-    
+
+    return true;
+}
+
+bool Triangle::has_intersection(const Ray &r) const {
+  // Part 1, Task 3: implement ray-triangle intersection
+  // The difference between this function and the next function is that the next
+  // function records the "intersection" while this function only tests whether
+  // there is a intersection.
+
+    double t, b2, b3;
+    if (!test(r, t, b2, b3)) {return false;}
+
     r.max_t = t;
     return true;
-    
 }
 
 bool Triangle::intersect(const Ray &r, Intersection *isect) const {
@@ -58,31 +76,20 @@ bool Triangle::intersect(const Ray &r, Intersection *isect) const {
   // implement ray-triangle intersection. When an intersection takes
   // place, the Intersection data should be updated accordingly
 
-    if (has_intersection(r) == false) {
-        return false;
-    }    
-    
-//    Vector3D p = r.o + r.max_t * r.d;
-    Vector3D e2 = p2 - p1;
-    Vector3D e3 = p3 - p1;
-    Vector3D s = r.o - p1;
-    Vector3D s2 = cross(r.d, e3);
-    Vector3D s3 = cross(s, e2);
-    
-//    double t = dot(s3, e3) / dot(s2, e2);
-    double b2 = dot(s2, s) / dot(s2, e2);
-    double b3 = dot(s3, r.d) / dot(s2, e2);
+    double t, b2, b3;
+    if (!test(r, t, b2, b3)) {return false;}
     double b1 = 1 - b2 - b3;
 
+    r.max_t = t;
+
     Vector3D n = b1 * n1 + b2 * n2 + b3 * n3;
     n.normalize();
     isect->n = n;
-    
+
     isect->primitive = this;
     isect->bsdf = get_bsdf();
-//    r.max_t = t;
     isect->t = r.max_t;
-    
+
   return true;
 }
 
@@ -6,6 +6,19 @@
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Single precision Moller-Trumbore layout of a triangle: one vertex and the
+ * two edges leaving it. The BVH keeps these next to its leaves so that the
+ * traversal can reject most triangles without touching the Triangle itself.
+ */
+struct PackedTriangle {
+  float p0[3];  ///< first vertex
+  float e1[3];  ///< edge from the first to the second vertex
+  float e2[3];  ///< edge from the first to the third vertex
+};
+
+static_assert(sizeof(PackedTriangle) == 36, "PackedTriangle should be 36 bytes");
+
 /**
  * A single triangle from a mesh.
  * To save space, it holds a pointer back to the data in the original mesh
@@ -32,6 +45,16 @@ public:
    */
   BBox get_bbox() const;
 
+  /**
+   * Ray - Triangle intersection test.
+   * \param r ray to test intersection with
+   * \param t distance along the ray of the intersection
+   * \param b2 barycentric coordinate of the second vertex
+   * \param b3 barycentric coordinate of the third vertex
+   * \return true if the ray hits the triangle within [min_t, max_t]
+   */
+  bool test(const Ray& r, double& t, double& b2, double& b3) const;
+
   /**
    * Ray - Triangle intersection.
    * Check if the given ray intersects with the triangle, no intersection
@@ -61,6 +84,11 @@ public:
    */
   BSDF* get_bsdf() const { return bsdf; }
 
+  /**
+   * Get the single precision intersection layout of the triangle.
+   */
+  PackedTriangle get_packed() const;
+
   /**
    * Draw with OpenGL (for visualizer)
    */
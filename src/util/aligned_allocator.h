@@ -0,0 +1,55 @@
+#ifndef __ALIGNED_ALLOCATOR_H__
+#define __ALIGNED_ALLOCATOR_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Allocator for standard containers whose storage starts on an Alignment
+ * byte boundary and owns whole cache lines, so that no other allocation
+ * shares a line with it. Alignment must be a power of two.
+ */
+template <class T, size_t Alignment = 64>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template <class U>
+  struct rebind {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() {}
+
+  template <class U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t n) {
+    // Pad the block by a line at both ends and keep the pointer malloc
+    // returned just before the aligned storage.
+    void* raw = std::malloc(n * sizeof(T) + 2 * Alignment + sizeof(void*));
+    if (!raw) throw std::bad_alloc();
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+    uintptr_t aligned = (start + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<T*>(aligned);
+  }
+
+  void deallocate(T* p, size_t) {
+    std::free(reinterpret_cast<void**>(p)[-1]);
+  }
+};
+
+template <class T, class U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+  return true;
+}
+
+template <class T, class U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+  return false;
+}
+
+#endif  // __ALIGNED_ALLOCATOR_H__
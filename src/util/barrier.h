@@ -0,0 +1,36 @@
+#ifndef __BARRIER_H__
+#define __BARRIER_H__
+
+#include <condition_variable>
+#include <mutex>
+
+/**
+ * Reusable barrier for a fixed number of threads: wait() blocks until all of
+ * them have called it, after which the barrier is ready for the next round.
+ */
+class Barrier {
+ private:
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t count;
+  size_t waiting;
+  size_t generation;
+
+ public:
+
+  explicit Barrier(size_t count) : count(count), waiting(0), generation(0) {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lk(lock);
+    size_t gen = generation;
+    if (++waiting == count) {
+      waiting = 0;
+      generation++;
+      cv.notify_all();
+    } else {
+      cv.wait(lk, [this, gen] { return gen != generation; });
+    }
+  }
+};
+
+#endif  // __BARRIER_H__
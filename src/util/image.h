@@ -4,12 +4,125 @@
 #include "CGL/color.h"
 #include "CGL/spectrum.h"
 
+#include <algorithm>
 #include <vector>
 #include <string.h>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 namespace CGL {
 
+/**
+ * Encodes linear values for display as bytes floor(255 * (scale * x)^(1 /
+ * gamma)), clamped to [0, 255], without calling pow. The byte is looked up
+ * from the exponent and top mantissa bits of the value, then raised by one
+ * if the value reaches the smallest input of the next byte. A table bucket
+ * spans less than one byte, so this is exact up to the rounding of those
+ * thresholds; pow itself rounds differently only at byte boundaries.
+ */
+class DisplayEncoder {
+ public:
+
+  DisplayEncoder(float gamma, float scale) {
+    // thresholds[k] is the smallest float encoded as k or above.
+    thresholds[0] = -INF_F;
+    for (int k = 1; k < 256; k++) {
+      double t = pow(k / 255.0, (double)gamma) / scale;
+      float f = (float)t;
+      thresholds[k] = (double)f < t ? nextafterf(f, INF_F) : f;
+    }
+    thresholds[256] = INF_F;
+
+    // Cover the buckets from the one below the smallest input of 1, where
+    // every value is 0, to an exponent above the smallest input of 255.
+    int32_t first = (float_bits(thresholds[1]) >> kBucketShift) - 1;
+    int32_t last = (float_bits(thresholds[255]) >> kBucketShift) +
+                   (1 << kMantissaBits);
+    base = first;
+    lut.resize(last - first + 1);
+    int byte = 0;
+    for (size_t i = 0; i < lut.size(); i++) {
+      float lower = bits_float((base + (int32_t)i) << kBucketShift);
+      while (byte < 255 && lower >= thresholds[byte + 1]) byte++;
+      lut[i] = byte;
+    }
+  }
+
+  /**
+   * Encodes one value.
+   */
+  uint8_t encode(float x) const {
+    int32_t byte = lut[bucket(float_bits(x))];
+    return byte + (x >= thresholds[byte + 1]);
+  }
+
+  /**
+   * Encodes n values.
+   */
+  void encode(const float* in, uint8_t* out, size_t n) const {
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i vbase = _mm256_set1_epi32(base);
+    __m256i vlast = _mm256_set1_epi32((int32_t)lut.size() - 1);
+    __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+      __m256 x = _mm256_loadu_ps(in + i);
+      __m256i index = _mm256_sub_epi32(
+          _mm256_srai_epi32(_mm256_castps_si256(x), kBucketShift), vbase);
+      index = _mm256_min_epi32(_mm256_max_epi32(index, zero), vlast);
+      __m256i byte = _mm256_i32gather_epi32(&lut[0], index, 4);
+      __m256 next = _mm256_i32gather_ps(thresholds + 1, byte, 4);
+      // The comparison mask is -1 where the value reaches the next byte.
+      byte = _mm256_sub_epi32(byte, _mm256_castps_si256(
+          _mm256_cmp_ps(x, next, _CMP_GE_OQ)));
+      __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(byte),
+                                       _mm256_extracti128_si256(byte, 1));
+      _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < n; i++) {
+      out[i] = encode(in[i]);
+    }
+  }
+
+ private:
+
+  // A bucket covers the floats sharing their exponent and kMantissaBits
+  // mantissa bits, 2^-kMantissaBits relative width. The slope of the
+  // encoding is at most 255 / gamma bytes per unit of log(x), so for gamma
+  // >= 1 a bucket spans less than half a byte.
+  static const int kMantissaBits = 8;
+  static const int kBucketShift = 23 - kMantissaBits;
+
+  static int32_t float_bits(float x) {
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+  }
+
+  static float bits_float(int32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+  }
+
+  // Negative values land in the first bucket, NaN and large ones in the
+  // last.
+  size_t bucket(int32_t bits) const {
+    int32_t i = (bits >> kBucketShift) - base;
+    return i < 0 ? 0 : std::min((size_t)i, lut.size() - 1);
+  }
+
+  float thresholds[257];
+  int32_t base;               ///< bucket of the first table entry
+  std::vector<int32_t> lut;   ///< byte at the lower end of each bucket
+};
+
 /**
  * Image buffer which stores color space values with RGBA pixel layout using
  * 32 bit unsigned integers (8-bits per color channel, high byte is padding).
@@ -81,17 +194,43 @@ struct ImageBuffer {
   std::vector<uint32_t> data;  ///< pixel buffer
 };
 
+/**
+ * Linear RGB pixel with channels of type T. Pixels convert to and from
+ * Spectrum, which holds doubles, only where they are read or written.
+ */
+template <class T>
+struct RGBPixel {
+  RGBPixel() : r(0), g(0), b(0) { }
+
+  explicit RGBPixel(const Spectrum& s) : r(s.r), g(s.g), b(s.b) { }
+
+  RGBPixel(T r, T g, T b) : r(r), g(g), b(b) { }
+
+  Spectrum spectrum() const { return Spectrum(r, g, b); }
+
+  float illum() const { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+
+  T r, g, b;
+};
+
+static_assert(sizeof(RGBPixel<float>) == 3 * sizeof(float),
+              "rows of float pixels must be plain arrays of channels");
+
 /**
  * High Dynamic Range image buffer which stores linear space spectrum
- * values with 32 bit floating points.
+ * values with channels of type T, 32 bit floating points by default (see
+ * HDRImageBuffer).
  */
-struct HDRImageBuffer {
+template <class T>
+struct HDRImageBufferT {
+
+  typedef RGBPixel<T> Pixel;
 
   /**
    * Default constructor.
    * The default constructor creates a zero-sized image.
    */
-  HDRImageBuffer() : w(0), h(0) { }
+  HDRImageBufferT() : w(0), h(0) { }
 
   /**
    * Parameterized constructor.
@@ -99,7 +238,7 @@ struct HDRImageBuffer {
    * \param w width of the image
    * \param h height of the image
    */
-  HDRImageBuffer(size_t w, size_t h) : w(w), h(h) { data.resize(w * h); }
+  HDRImageBufferT(size_t w, size_t h) : w(w), h(h) { data.resize(w * h); }
 
   /**
    * Resize the image buffer.
@@ -122,7 +261,7 @@ struct HDRImageBuffer {
   void update_pixel(const Spectrum& s, size_t x, size_t y) {
     // assert(0 <= x && x < w);
     // assert(0 <= y && y < h);
-    data[x + y * w] = s;
+    data[x + y * w] = Pixel(s);
   }
 
   /**
@@ -137,7 +276,16 @@ struct HDRImageBuffer {
   void update_pixel(const Spectrum& s, size_t x, size_t y, float r) {
     // assert(0 <= x && x < w);
     // assert(0 <= y && y < h);
-    data[x + y * w] = s * r + (1 - r) * data[x + y * w];
+    data[x + y * w] = Pixel(s * r + (1 - r) * data[x + y * w].spectrum());
+  }
+
+  /**
+   * Color of a given pixel.
+   * \param x row of the pixel
+   * \param y column of the pixel
+   */
+  Spectrum get_pixel(size_t x, size_t y) const {
+    return data[x + y * w].spectrum();
   }
 
   /**
@@ -150,53 +298,70 @@ struct HDRImageBuffer {
    */
   void tonemap(ImageBuffer& target,
     float gamma, float level, float key, float wht) {
+    if (w * h == 0) return;
 
     // compute global log average luminance!
-    float avg = 0;
+    double avg = 0;
     for (size_t i = 0; i < w * h; ++i) {
       // the small delta value below is used to avoids singularity
       avg += log(0.0000001f + data[i].illum());
     }
     avg = exp(avg / (w * h));
 
-
-    // apply on pixels
-    float one_over_gamma = 1.0f / gamma;
+    // apply on pixels. The white point term scales every pixel by 1 / wht^2,
+    // so the whole tone curve is one scale ahead of the gamma encoding.
     float exposure = sqrt(pow(2,level));
-    for (size_t y = 0; y < h; ++y) {
-      for (size_t x = 0; x < w; ++x) {
-        Spectrum s = data[x + y * w];
-        float l = s.illum();
-        s *= key / avg;
-        s *= ((l + 1) / (wht * wht)) / (l + 1);
-        float r = pow(s.r * exposure, one_over_gamma);
-        float g = pow(s.g * exposure, one_over_gamma);
-        float b = pow(s.b * exposure, one_over_gamma);
-        target.update_pixel(Color(r, g, b), x, y);
-      }
-    }
+    DisplayEncoder encoder(gamma, exposure * key / (avg * wht * wht));
+    encode(encoder, target, 0, 0, w, h);
   }
 
   /**
    * Convert the given tile of the buffer to color.
    */
   void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1) {
+    static const DisplayEncoder encoder(2.2f, sqrt(2.0f));
+    encode(encoder, target, x0, y0, x1, y1);
+  }
 
-    float gamma = 2.2f;
-    float level = 1.0f;
-    float one_over_gamma = 1.0f / gamma;
-    float exposure = sqrt(pow(2,level));
+  /**
+   * Encodes the given tile of the buffer into target, a row at a time.
+   */
+  void encode(const DisplayEncoder& encoder, ImageBuffer& target,
+              size_t x0, size_t y0, size_t x1, size_t y1) const {
+    size_t n = 3 * (x1 - x0);
+    std::vector<float> values;
+    std::vector<uint8_t> bytes(n);
     for (size_t y = y0; y < y1; ++y) {
-      for (size_t x = x0; x < x1; ++x) {
-        const Spectrum& s = data[x + y * w];
-        float r = pow(s.r * exposure, one_over_gamma);
-        float g = pow(s.g * exposure, one_over_gamma);
-        float b = pow(s.b * exposure, one_over_gamma);
-        target.update_pixel(Color(r, g, b), x, y);
+      encoder.encode(channels(&data[x0 + y * w], x1 - x0, values), &bytes[0], n);
+      uint32_t* out = &target.data[x0 + y * target.w];
+      for (size_t x = x0, i = 0; x < x1; ++x, i += 3) {
+        *out++ = 0xFF000000 | (uint32_t)bytes[i + 2] << 16 |
+                 (uint32_t)bytes[i + 1] << 8 | bytes[i];
       }
     }
   }
 
+  /**
+   * The channels of n pixels as floats: float pixels as they are, others
+   * converted into values.
+   */
+  static const float* channels(const RGBPixel<float>* pixels, size_t n,
+                               std::vector<float>& values) {
+    return &pixels->r;
+  }
+
+  template <class U>
+  static const float* channels(const RGBPixel<U>* pixels, size_t n,
+                               std::vector<float>& values) {
+    values.resize(3 * n);
+    for (size_t i = 0; i < n; ++i) {
+      values[3 * i] = pixels[i].r;
+      values[3 * i + 1] = pixels[i].g;
+      values[3 * i + 2] = pixels[i].b;
+    }
+    return &values[0];
+  }
+
   /**
    * If the buffer is empty
    */
@@ -207,14 +372,20 @@ struct HDRImageBuffer {
    */
   void clear() {
     data.clear();
-    data.resize(w * h, Spectrum(0.0));
+    data.resize(w * h, Pixel());
   }
 
   size_t w; ///< width
   size_t h; ///< height
-  std::vector<Spectrum> data; ///< pixel buffer
+  std::vector<Pixel> data; ///< pixel buffer
 
-}; // class HDRImageBuffer
+}; // class HDRImageBufferT
+
+/**
+ * HDR buffer of 32 bit float channels, 12 bytes a pixel against 32 for a
+ * Spectrum, used for the sample buffer and environment maps.
+ */
+typedef HDRImageBufferT<float> HDRImageBuffer;
 
 
 } // namespace CGL
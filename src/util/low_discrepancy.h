@@ -0,0 +1,104 @@
+#ifndef CGL_LOW_DISCREPANCY_H
+#define CGL_LOW_DISCREPANCY_H
+
+#include <stdint.h>
+
+namespace CGL {
+
+/**
+ * Reverses the bits of x.
+ */
+inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+/**
+ * Point index of the first two dimensions of the Sobol sequence, as 32 bit
+ * fractions: the van der Corput sequence and its second dimension, whose
+ * direction numbers follow from v_1 = 1/2, v_k = v_(k-1) ^ (v_(k-1) / 2).
+ */
+inline uint32_t sobol(uint32_t index, int dim) {
+  if (dim == 0) return reverse_bits(index);
+  uint32_t x = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) x ^= v;
+  }
+  return x;
+}
+
+/**
+ * Random permutation of the bits of x in which each bit is flipped
+ * depending only on the bits below it (Laine and Karras, "Stratified
+ * Sampling for Stochastic Transparency", 2011).
+ */
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+/**
+ * Owen scrambling of a 32 bit fraction: each bit is flipped depending on
+ * the bits above it, which keeps the stratification of a Sobol sequence.
+ */
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/**
+ * Dimension dim (0 or 1) of point index of a 2D Owen scrambled Sobol
+ * sequence whose point order is shuffled, both by a random seed. Padding a
+ * sequence with such pairs, each seeded independently, decorrelates the
+ * pairs while each stays stratified (Burley, "Practical Hash-based Owen
+ * Scrambling", JCGT 2020).
+ */
+inline uint32_t sobol_owen(uint32_t index, int dim, uint64_t seed) {
+  uint32_t shuffled = owen_scramble(index, (uint32_t)seed);
+  uint32_t scramble = (uint32_t)(seed >> 32) ^ (dim ? 0x9e3779b9u : 0);
+  return owen_scramble(sobol(shuffled, dim), scramble);
+}
+
+// Bases of the Halton dimensions; later dimensions are random.
+static const uint32_t kHaltonPrimes[] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+static const uint32_t kHaltonDimensions =
+    sizeof(kHaltonPrimes) / sizeof(kHaltonPrimes[0]);
+
+/**
+ * Radical inverse of index in the given base, in [0, 1).
+ */
+inline double radical_inverse(uint32_t base, uint32_t index) {
+  double inv_base = 1.0 / base;
+  double scale = inv_base;
+  double x = 0;
+  while (index) {
+    x += (index % base) * scale;
+    index /= base;
+    scale *= inv_base;
+  }
+  return x;
+}
+
+/**
+ * Dimension dim < kHaltonDimensions of point index of the Halton sequence,
+ * rotated by the given 32 bit fraction (Cranley-Patterson rotation).
+ */
+inline double halton(uint32_t index, uint32_t dim, uint32_t rotation) {
+  double x = radical_inverse(kHaltonPrimes[dim], index) +
+             rotation * (1.0 / 4294967296.0);
+  return x < 1 ? x : x - 1;
+}
+
+} // namespace CGL
+
+#endif  // CGL_LOW_DISCREPANCY_H
@@ -1,62 +1,97 @@
 #ifndef CGL_RANDOMUTIL_H
 #define CGL_RANDOMUTIL_H
 
-#include <random>
+#include <stdint.h>
 
-#define XORSHIFT_RAND
+#include "util/low_discrepancy.h"
 
 namespace CGL {
 
-#ifndef XORSHIFT_RAND
-
-#ifdef __GNUC__
-static std::mersenne_twister_engine<std::uint_fast32_t, 32, 624, 397, 31, 0x9908b0df,
-                             11, 0xffffffff, 7, 0x9d2c5680, 15, 0xefc60000, 18,
-                             1812433253> minstd_engine;
-
-static float rmax = 1.0 / (minstd_engine.max() - minstd_engine.min());
-#endif
+/**
+ * SplitMix64 finalizer, used to turn pixel and sample indices into
+ * uncorrelated generator seeds.
+ */
+inline uint64_t splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
 
-#else
-#include <stdint.h>
+/**
+ * Sequences the numbers of a pixel sample are drawn from.
+ */
+enum SampleSequence {
+  SEQUENCE_RANDOM,  ///< independent random numbers
+  SEQUENCE_SOBOL,   ///< Owen scrambled Sobol pairs, see sobol_owen
+  SEQUENCE_HALTON   ///< Halton, rotated per pixel, random past its dimensions
+};
 
-static struct xorshift32_state {
-  uint32_t a = 0x12345678;
-} rng_state;
+/**
+ * Random number stream of one pixel sample: a PCG32 generator (O'Neill,
+ * "PCG: A Family of Simple Fast Space-Efficient Statistically Good
+ * Algorithms for Random Number Generation"). Each sample is seeded from its
+ * pixel and sample index, so the random numbers it sees do not depend on
+ * which thread traces it, and threads share no generator state.
+ *
+ * With a low-discrepancy sequence, the k-th number drawn is dimension k of
+ * point sample of the sequence, scrambled per pixel. Camera, light and BSDF
+ * samples each draw their own dimensions, in the order the integrator
+ * uses them.
+ */
+struct SamplerState {
+  uint64_t state;
+  uint64_t inc;
+  uint64_t seed;             ///< scrambling seed of the pixel
+  uint32_t sample;           ///< point index in the sequence
+  uint32_t dimension;        ///< dimension of the next number drawn
+  SampleSequence sequence;
 
-const static double inv_uint32_max = 1.0 / (double) UINT32_MAX;
+  SamplerState(uint64_t pixel = 0, uint64_t sample = 0,
+               SampleSequence sequence = SEQUENCE_RANDOM)
+      : seed(splitmix64(pixel)), sample((uint32_t)sample), dimension(0),
+        sequence(sequence) {
+    // pcg32_srandom_r, with one stream per pixel.
+    state = 0;
+    inc = (pixel << 1) | 1;
+    next();
+    state += splitmix64(seed ^ sample);
+    next();
+  }
 
-/* The state word must be initialized to non-zero */
-inline uint32_t xorshift32(xorshift32_state &state) {
-  /* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
-  uint32_t x = state.a;
-  x ^= x << 13;
-  x ^= x >> 17;
-  x ^= x << 5;
-  return state.a = x;
-}
-#endif
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ull + inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+};
 
 /**
- * Returns a number distributed uniformly over [0, 1].
+ * Returns a number distributed uniformly over [0, 1).
  */
-inline double random_uniform() {
-#ifdef XORSHIFT_RAND
-  return (double)xorshift32(rng_state) * inv_uint32_max;
-#else
-#ifdef __GNUC__
-  return (double)(minstd_engine() - minstd_engine.min()) * rmax;
-#else
-  return (double)std::rand() / RAND_MAX;
-#endif
-#endif
+inline double random_uniform(SamplerState& rng) {
+  uint32_t dim = rng.dimension++;
+  switch (rng.sequence) {
+    case SEQUENCE_SOBOL:
+      return sobol_owen(rng.sample, dim & 1, splitmix64(rng.seed ^ (dim >> 1))) *
+             (1.0 / 4294967296.0);
+    case SEQUENCE_HALTON:
+      if (dim < kHaltonDimensions) {
+        return halton(rng.sample, dim, (uint32_t)splitmix64(rng.seed ^ dim));
+      }
+      // fall through
+    default:
+      return rng.next() * (1.0 / 4294967296.0);
+  }
 }
 
 /**
  * Returns true with probability p and false with probability 1 - p.
  */
-inline bool coin_flip(double p) {
-  return random_uniform() < p;
+inline bool coin_flip(SamplerState& rng, double p) {
+  return random_uniform(rng) < p;
 }
 
 } // namespace CGL
@@ -0,0 +1,197 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+/**
+ * Fixed set of threads that park on a condition variable between jobs. A job
+ * runs once on every thread, which gets its index in the pool; jobs are
+ * started with run() and waited for with wait(), one at a time.
+ *
+ * Between jobs the threads also run tasks: single calls submitted to a
+ * TaskGroup and waited for as a group, for fork-join work such as building
+ * the halves of a tree. Tasks may submit and wait for tasks of their own.
+ */
+class ThreadPool {
+ public:
+
+  /**
+   * Tasks waited for together. Counts the tasks submitted to it that have
+   * not finished yet.
+   */
+  class TaskGroup {
+    friend class ThreadPool;
+    size_t pending;  ///< guarded by the lock of the pool
+   public:
+    TaskGroup() : pending(0) { }
+  };
+
+ private:
+  struct Task {
+    std::function<void()> f;
+    TaskGroup* group;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable cv_job;   ///< signals a new job or task, a finished
+                                    ///< task group, or shutdown
+  std::condition_variable cv_idle;  ///< signals the end of a job
+  std::function<void(size_t)> job;
+  size_t generation;                ///< number of jobs started
+  size_t running;                   ///< threads still in the current job
+  std::deque<Task> tasks;           ///< tasks not started yet, oldest first
+  bool shutdown;
+
+  /**
+   * The pool the calling thread belongs to, NULL outside of any pool.
+   */
+  static const ThreadPool*& current_pool() {
+    static thread_local const ThreadPool* pool = NULL;
+    return pool;
+  }
+
+  /**
+   * Runs the oldest queued task, or the newest with newest set, with lk
+   * held on entry and on return.
+   */
+  void run_task(std::unique_lock<std::mutex>& lk, bool newest) {
+    Task task;
+    if (newest) {
+      task = tasks.back();
+      tasks.pop_back();
+    } else {
+      task = tasks.front();
+      tasks.pop_front();
+    }
+    lk.unlock();
+    task.f();
+    lk.lock();
+    if (--task.group->pending == 0) cv_job.notify_all();
+  }
+
+  void worker(size_t index) {
+    current_pool() = this;
+    size_t seen = 0;
+    std::unique_lock<std::mutex> lk(lock);
+    while (true) {
+      cv_job.wait(lk, [this, &seen] {
+        return shutdown || generation != seen || !tasks.empty();
+      });
+      if (shutdown) return;
+      if (generation == seen) {
+        // Idle threads take the oldest tasks, the largest in fork-join work.
+        run_task(lk, false);
+        continue;
+      }
+      seen = generation;
+      lk.unlock();
+      job(index);
+      lk.lock();
+      if (--running == 0) cv_idle.notify_all();
+    }
+  }
+
+ public:
+
+  /**
+   * Starts num_threads threads. With pin_threads, thread i is bound to CPU i
+   * (modulo the CPU count) where the platform supports it.
+   */
+  ThreadPool(size_t num_threads, bool pin_threads = false)
+      : generation(0), running(0), shutdown(false) {
+    size_t num_cpus = std::thread::hardware_concurrency();
+    for (size_t i = 0; i < num_threads; i++) {
+      threads.push_back(std::thread(&ThreadPool::worker, this, i));
+#ifdef __linux__
+      if (pin_threads && num_cpus > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % num_cpus, &cpus);
+        pthread_setaffinity_np(threads[i].native_handle(), sizeof(cpus), &cpus);
+      }
+#endif
+    }
+  }
+
+  /**
+   * Waits for the current job, then stops and joins all threads.
+   */
+  ~ThreadPool() {
+    wait();
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      shutdown = true;
+    }
+    cv_job.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+  }
+
+  size_t size() const {
+    return threads.size();
+  }
+
+  /**
+   * Runs f(i) on every thread i of the pool and returns without waiting.
+   * The previous job must have finished.
+   */
+  void run(const std::function<void(size_t)>& f) {
+    std::lock_guard<std::mutex> lk(lock);
+    job = f;
+    running = threads.size();
+    generation++;
+    cv_job.notify_all();
+  }
+
+  /**
+   * Blocks until every thread has returned from the current job.
+   */
+  void wait() {
+    std::unique_lock<std::mutex> lk(lock);
+    cv_idle.wait(lk, [this] { return running == 0; });
+  }
+
+  /**
+   * Queues f to run on a thread of the pool as part of group.
+   */
+  void submit(TaskGroup& group, const std::function<void()>& f) {
+    std::lock_guard<std::mutex> lk(lock);
+    Task task = {f, &group};
+    tasks.push_back(task);
+    group.pending++;
+    // Waiters share the condition variable, so wake them all for the one
+    // idle thread that may be among them.
+    cv_job.notify_all();
+  }
+
+  /**
+   * Blocks until every task of group has finished. A thread of the pool
+   * runs queued tasks meanwhile, the newest first, so that tasks waiting
+   * for the tasks they submitted never hold up the pool; other threads only
+   * wait.
+   */
+  void wait(TaskGroup& group) {
+    bool help = current_pool() == this;
+    std::unique_lock<std::mutex> lk(lock);
+    while (group.pending > 0) {
+      if (help && !tasks.empty()) {
+        run_task(lk, true);
+      } else {
+        cv_job.wait(lk);
+      }
+    }
+  }
+};
+
+#endif  // __THREAD_POOL_H__
@@ -0,0 +1,283 @@
+#ifndef __WORK_STEALING_QUEUE_H__
+#define __WORK_STEALING_QUEUE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+/**
+ * Fixed capacity Chase-Lev deque (Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models", PPoPP 2013). The owning thread
+ * pushes and pops at the bottom without taking a lock; any other thread may
+ * steal from the top. T must be trivially copyable and cheap to copy.
+ */
+template <class T>
+class WorkStealingDeque {
+ private:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "WorkStealingDeque items are copied word by word");
+
+  // A thief may read a slot while the owner rewrites it, and then loses the
+  // race for top and drops what it read, so slots are relaxed atomic words.
+  static const size_t kSlotWords =
+      (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  struct Slot {
+    std::atomic<uint64_t> words[kSlotWords];
+  };
+
+  // top and bottom live on their own cache lines, as thieves write the first
+  // and the owner the second.
+  char pad0[64];
+  std::atomic<int64_t> top;
+  char pad1[64];
+  std::atomic<int64_t> bottom;
+  char pad2[64];
+  std::unique_ptr<Slot[]> buffer;
+  int64_t mask;
+
+  void store(int64_t i, const T& item) {
+    uint64_t words[kSlotWords] = {};
+    memcpy(words, &item, sizeof(T));
+    Slot& slot = buffer[i & mask];
+    for (size_t w = 0; w < kSlotWords; w++) {
+      slot.words[w].store(words[w], std::memory_order_relaxed);
+    }
+  }
+
+  T load(int64_t i) const {
+    uint64_t words[kSlotWords];
+    const Slot& slot = buffer[i & mask];
+    for (size_t w = 0; w < kSlotWords; w++) {
+      words[w] = slot.words[w].load(std::memory_order_relaxed);
+    }
+    T item;
+    memcpy(&item, words, sizeof(T));
+    return item;
+  }
+
+ public:
+
+  WorkStealingDeque() : top(0), bottom(0), mask(0) {}
+
+  /**
+   * Empties the deque and makes room for capacity items, rounded up to a
+   * power of two. Not thread safe.
+   */
+  void reset(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    buffer.reset(new Slot[size]());
+    mask = size - 1;
+    top.store(0, std::memory_order_relaxed);
+    bottom.store(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * Largest number of items the deque can hold.
+   */
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+  /**
+   * Number of items in the deque, which may be stale by the time it returns.
+   */
+  size_t size() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+  }
+
+  /**
+   * Adds an item at the bottom. Owner only. Returns false if the deque is full.
+   */
+  bool push(const T& item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t > mask) return false;
+    store(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * Takes the item at the bottom, the one pushed last. Owner only.
+   */
+  bool pop(T* outPtr) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    *outPtr = load(b);
+    if (t == b) {
+      // Last item: race the thieves for it.
+      bool won = top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /**
+   * Takes the item at the top, the oldest one. Safe from any thread; fails
+   * when the deque is empty or another thread got the item first.
+   */
+  bool steal(T* outPtr) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return false;
+    T item = load(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return false;
+    }
+    *outPtr = item;
+    return true;
+  }
+};
+
+/**
+ * Work-stealing scheduler for a fixed set of workers. Each worker has its
+ * own deque and takes work from it without locking. A worker whose deque is
+ * empty steals half of the items of the fullest other worker. Work counts
+ * as pending from put_work until the matching finish_work, so workers can
+ * tell an empty scheduler from one that is only momentarily out of items
+ * while others may still add more; such workers sleep in wait_for_work.
+ */
+template <class T>
+class WorkStealingQueue {
+ private:
+  std::unique_ptr<WorkStealingDeque<T>[]> deques;
+  size_t num_workers;
+  std::atomic<int> queued;   ///< items in all deques
+  std::atomic<int> pending;  ///< items put but not finished
+  std::atomic<int> sleepers; ///< workers in wait_for_work
+  std::mutex lock;
+  std::condition_variable cv;
+
+  /**
+   * Wakes the sleeping workers, if any. Waiters count themselves under the
+   * lock before they check for work, so a change made before this call is
+   * either seen by their check or followed by this notification.
+   */
+  void wake_sleepers() {
+    if (sleepers == 0) return;
+    std::lock_guard<std::mutex> lk(lock);
+    cv.notify_all();
+  }
+
+ public:
+
+  WorkStealingQueue() : num_workers(0), queued(0), pending(0), sleepers(0) {}
+
+  /**
+   * Drops all work and sets up num_workers empty deques of the given
+   * capacity. Not thread safe.
+   */
+  void reset(size_t num_workers, size_t capacity) {
+    this->num_workers = num_workers;
+    deques.reset(new WorkStealingDeque<T>[num_workers]);
+    for (size_t i = 0; i < num_workers; i++) {
+      deques[i].reset(capacity);
+    }
+    queued = 0;
+    pending = 0;
+  }
+
+  /**
+   * Adds work to the deque of worker, from that worker or while no worker
+   * runs. Returns false if the deque is full.
+   */
+  bool put_work(size_t worker, const T& item) {
+    if (!deques[worker].push(item)) return false;
+    pending++;
+    queued++;
+    wake_sleepers();
+    return true;
+  }
+
+  /**
+   * Number of items that worker can still put in its own deque.
+   */
+  size_t room(size_t worker) const {
+    return deques[worker].capacity() - deques[worker].size();
+  }
+
+  /**
+   * Gets the next item for worker: the last one it put, or else the oldest
+   * of the ones it steals. Returns false if no item was found.
+   */
+  bool try_get_work(size_t worker, T* outPtr) {
+    if (deques[worker].pop(outPtr)) {
+      queued--;
+      return true;
+    }
+
+    size_t victim = worker;
+    size_t victim_size = 0;
+    for (size_t i = 0; i < num_workers; i++) {
+      size_t size = deques[i].size();
+      if (i != worker && size > victim_size) {
+        victim = i;
+        victim_size = size;
+      }
+    }
+    if (victim == worker || !deques[victim].steal(outPtr)) return false;
+    queued--;
+
+    // Steal half: move more of the victim's items over to our own deque,
+    // which is empty and as large as the victim's, so always has room.
+    T item;
+    for (size_t n = 1; n < (victim_size + 1) / 2; n++) {
+      if (!deques[victim].steal(&item)) break;
+      deques[worker].push(item);
+    }
+    return true;
+  }
+
+  /**
+   * Marks an item returned by try_get_work as done.
+   */
+  void finish_work() {
+    if (--pending == 0) wake_sleepers();
+  }
+
+  /**
+   * Blocks until there are items to get or every item put has been
+   * finished.
+   */
+  void wait_for_work() {
+    std::unique_lock<std::mutex> lk(lock);
+    sleepers++;
+    cv.wait(lk, [this] { return queued > 0 || pending == 0; });
+    sleepers--;
+  }
+
+  /**
+   * Number of items waiting in the deques.
+   */
+  int num_queued() const {
+    return queued;
+  }
+
+  /**
+   * True once every item put has been finished.
+   */
+  bool is_done() const {
+    return pending == 0;
+  }
+};
+
+#endif  // __WORK_STEALING_QUEUE_H__
@@ -0,0 +1,271 @@
+// Regression test for BVHAccel ray queries.
+//
+// Builds a BVH over random triangles and spheres with every split method and
+// checks that closest-hit, any-hit and ray packet queries agree with a brute
+// force loop over all primitives, and that building on a thread pool gives the
+// same tree as building on one thread.
+
+#include "scene/bvh.h"
+#include "scene/object.h"
+#include "scene/sphere.h"
+#include "scene/triangle.h"
+#include "pathtracer/bsdf.h"
+#include "pathtracer/intersection.h"
+#include "util/thread_pool.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <vector>
+
+using namespace CGL;
+using namespace CGL::SceneObjects;
+
+static const size_t kNumTriangles = 2000;
+static const size_t kNumSpheres = 200;
+static const size_t kNumRays = 20000;
+
+// Enough spheres for the build to fork subtrees and split the bounds and
+// bins of the top levels into chunks.
+static const size_t kNumParallelSpheres = 100000;
+static const size_t kNumParallelThreads = 4;
+static const size_t kNumParallelRays = 1000;
+
+static double uniform() {
+  return (double)rand() / RAND_MAX;
+}
+
+static Vector3D random_point(double extent) {
+  return Vector3D(extent * (2 * uniform() - 1),
+                  extent * (2 * uniform() - 1),
+                  extent * (2 * uniform() - 1));
+}
+
+static Vector3D random_direction() {
+  double z = 2 * uniform() - 1;
+  double r = sqrt(std::max(0.0, 1 - z * z));
+  double phi = 2 * PI * uniform();
+  return Vector3D(r * cos(phi), r * sin(phi), z);
+}
+
+static bool brute_force_intersect(const std::vector<Primitive*>& primitives,
+                                  const Ray& ray, Intersection* isect) {
+  bool hit = false;
+  for (size_t p = 0; p < primitives.size(); p++) {
+    hit = primitives[p]->intersect(ray, isect) || hit;
+  }
+  return hit;
+}
+
+static bool brute_force_has_intersection(
+    const std::vector<Primitive*>& primitives, const Ray& ray) {
+  for (size_t p = 0; p < primitives.size(); p++) {
+    if (primitives[p]->has_intersection(ray)) return true;
+  }
+  return false;
+}
+
+static size_t check_queries(const std::vector<Primitive*>& primitives,
+                            BVHSplitMethod split_method, const char* name) {
+
+  BVHAccel bvh(primitives, 4, split_method);
+  srand(1234);
+
+  size_t failures = 0;
+  for (size_t n = 0; n < kNumRays; n++) {
+    Vector3D o = random_point(12);
+    Vector3D d = random_direction();
+    // Mix unbounded rays with short segments, as cast for shadow rays.
+    double max_t = (n % 2) ? INF_D : 20 * uniform();
+
+    Ray bvh_ray(o, d, max_t);
+    Ray ref_ray(o, d, max_t);
+    Intersection bvh_isect, ref_isect;
+    bool bvh_hit = bvh.intersect(bvh_ray, &bvh_isect);
+    bool ref_hit = brute_force_intersect(primitives, ref_ray, &ref_isect);
+
+    if (bvh_hit != ref_hit ||
+        (ref_hit && (bvh_isect.t != ref_isect.t ||
+                     bvh_isect.primitive != ref_isect.primitive))) {
+      if (failures < 10) {
+        fprintf(stderr, "[%s] closest hit mismatch on ray %zu: "
+                "bvh %d t=%f, brute force %d t=%f\n", name, n,
+                bvh_hit, bvh_isect.t, ref_hit, ref_isect.t);
+      }
+      failures++;
+    }
+
+    // The pointer tree kept for the visualizer has its own traversal.
+    Ray tree_ray(o, d, max_t);
+    Intersection tree_isect;
+    bool tree_hit = bvh.intersect(tree_ray, &tree_isect, bvh.get_root());
+    if (tree_hit != ref_hit || (ref_hit && tree_isect.t != ref_isect.t)) {
+      if (failures < 10) {
+        fprintf(stderr, "[%s] tree closest hit mismatch on ray %zu: "
+                "tree %d t=%f, brute force %d t=%f\n", name, n,
+                tree_hit, tree_isect.t, ref_hit, ref_isect.t);
+      }
+      failures++;
+    }
+
+    Ray bvh_shadow(o, d, max_t);
+    Ray ref_shadow(o, d, max_t);
+    bool bvh_any = bvh.has_intersection(bvh_shadow);
+    bool ref_any = brute_force_has_intersection(primitives, ref_shadow);
+    Ray tree_shadow(o, d, max_t);
+    bool tree_any = bvh.has_intersection(tree_shadow, bvh.get_root());
+    if (bvh_any != ref_any || tree_any != ref_any) {
+      if (failures < 10) {
+        fprintf(stderr, "[%s] any hit mismatch on ray %zu: "
+                "bvh %d, tree %d, brute force %d\n", name, n,
+                bvh_any, tree_any, ref_any);
+      }
+      failures++;
+    }
+  }
+
+  // Packets of coherent rays from a common origin, with some lanes inactive.
+  for (size_t n = 0; n < kNumRays; n += kRayPacketSize) {
+    Vector3D o = random_point(12);
+    Vector3D d = random_direction();
+    std::vector<Ray> packet;
+    uint32_t active = 0;
+    for (size_t k = 0; k < kRayPacketSize; k++) {
+      Vector3D jitter = random_point(0.05);
+      packet.push_back(Ray(o, (d + jitter).unit(), (k % 3) ? INF_D : 15.0));
+      if (rand() % 8) active |= 1u << k;
+    }
+
+    Intersection isects[kRayPacketSize];
+    uint32_t hits = bvh.intersect_packet(&packet[0], isects, active);
+
+    for (size_t k = 0; k < kRayPacketSize; k++) {
+      Ray ref_ray(packet[k].o, packet[k].d, (k % 3) ? INF_D : 15.0);
+      Intersection ref_isect;
+      bool ref_hit = (active & (1u << k)) &&
+                     brute_force_intersect(primitives, ref_ray, &ref_isect);
+      bool packet_hit = (hits & (1u << k)) != 0;
+      if (packet_hit != ref_hit ||
+          (ref_hit && isects[k].t != ref_isect.t)) {
+        if (failures < 10) {
+          fprintf(stderr, "[%s] packet mismatch on ray %zu: "
+                  "packet %d t=%f, brute force %d t=%f\n", name, n + k,
+                  packet_hit, isects[k].t, ref_hit, ref_isect.t);
+        }
+        failures++;
+      }
+    }
+  }
+
+  printf("[%s] %zu rays, %zu mismatches\n", name, 2 * kNumRays, failures);
+  return failures;
+}
+
+static size_t check_parallel_build(const std::vector<Primitive*>& primitives,
+                                   BVHSplitMethod split_method,
+                                   const char* name) {
+
+  ThreadPool pool(kNumParallelThreads);
+  BVHAccel serial(primitives, 4, split_method);
+  BVHAccel parallel(primitives, 4, split_method, BVHCostModel(), &pool);
+  srand(1234);
+
+  size_t failures = 0;
+  if (parallel.get_sah_cost() != serial.get_sah_cost()) {
+    fprintf(stderr, "[%s] parallel build SAH cost %f, serial %f\n", name,
+            parallel.get_sah_cost(), serial.get_sah_cost());
+    failures++;
+  }
+
+  for (size_t n = 0; n < kNumParallelRays; n++) {
+    Vector3D o = random_point(12);
+    Vector3D d = random_direction();
+
+    Ray parallel_ray(o, d);
+    Ray serial_ray(o, d);
+    Ray ref_ray(o, d);
+    Intersection parallel_isect, serial_isect, ref_isect;
+    bool parallel_hit = parallel.intersect(parallel_ray, &parallel_isect);
+    bool serial_hit = serial.intersect(serial_ray, &serial_isect);
+    bool ref_hit = brute_force_intersect(primitives, ref_ray, &ref_isect);
+
+    if (parallel_hit != ref_hit || serial_hit != ref_hit ||
+        (ref_hit && (parallel_isect.primitive != ref_isect.primitive ||
+                     serial_isect.primitive != ref_isect.primitive))) {
+      if (failures < 10) {
+        fprintf(stderr, "[%s] parallel build mismatch on ray %zu: "
+                "parallel %d t=%f, serial %d t=%f, brute force %d t=%f\n",
+                name, n, parallel_hit, parallel_isect.t, serial_hit,
+                serial_isect.t, ref_hit, ref_isect.t);
+      }
+      failures++;
+    }
+  }
+
+  printf("[%s] parallel build, %zu rays, %zu mismatches\n", name,
+         kNumParallelRays, failures);
+  return failures;
+}
+
+int main(int argc, char** argv) {
+
+  srand(42);
+  DiffuseBSDF bsdf(Spectrum(0.5, 0.5, 0.5));
+
+  // A soup of small, randomly oriented triangles.
+  std::vector<std::vector<size_t> > polygons;
+  std::vector<Vector3D> positions;
+  std::vector<Vector2D> texcoords;
+  for (size_t t = 0; t < kNumTriangles; t++) {
+    Vector3D c = random_point(10);
+    std::vector<size_t> polygon;
+    for (int v = 0; v < 3; v++) {
+      polygon.push_back(positions.size());
+      positions.push_back(c + random_point(1));
+    }
+    polygons.push_back(polygon);
+  }
+  HalfedgeMesh halfedge_mesh;
+  halfedge_mesh.build(polygons, positions, texcoords);
+  Mesh mesh(halfedge_mesh, &bsdf);
+
+  // Primitive has no virtual destructor, so the primitives are owned by
+  // their concrete types and the BVH gets a view of them. A deque keeps the
+  // spheres, which their primitives point to, in place as it grows.
+  std::vector<std::unique_ptr<Triangle> > triangles;
+  std::vector<Primitive*> primitives = mesh.get_primitives();
+  for (size_t p = 0; p < primitives.size(); p++) {
+    triangles.emplace_back(static_cast<Triangle*>(primitives[p]));
+  }
+
+  std::deque<SphereObject> sphere_objects;
+  std::vector<std::unique_ptr<Sphere> > spheres;
+  for (size_t s = 0; s < kNumSpheres; s++) {
+    sphere_objects.emplace_back(random_point(10), 0.1 + 0.4 * uniform(), &bsdf);
+    Primitive* sphere = sphere_objects.back().get_primitives()[0];
+    spheres.emplace_back(static_cast<Sphere*>(sphere));
+    primitives.push_back(sphere);
+  }
+
+  size_t failures = 0;
+  failures += check_queries(primitives, BVH_SPLIT_MIDPOINT, "midpoint");
+  failures += check_queries(primitives, BVH_SPLIT_SAH, "sah");
+  failures += check_queries(primitives, BVH_SPLIT_LBVH, "lbvh");
+
+  std::vector<Primitive*> many_spheres;
+  for (size_t s = 0; s < kNumParallelSpheres; s++) {
+    sphere_objects.emplace_back(random_point(10), 0.01 + 0.04 * uniform(),
+                                &bsdf);
+    Primitive* sphere = sphere_objects.back().get_primitives()[0];
+    spheres.emplace_back(static_cast<Sphere*>(sphere));
+    many_spheres.push_back(sphere);
+  }
+
+  failures += check_parallel_build(many_spheres, BVH_SPLIT_MIDPOINT, "midpoint");
+  failures += check_parallel_build(many_spheres, BVH_SPLIT_SAH, "sah");
+  failures += check_parallel_build(many_spheres, BVH_SPLIT_LBVH, "lbvh");
+
+  return failures == 0 ? 0 : 1;
+}
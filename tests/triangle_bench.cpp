@@ -0,0 +1,83 @@
+// Micro-benchmark for the BVH triangle block kernel.
+//
+// Tests random rays against blocks of random triangles with the scalar and
+// the SIMD version of intersect_triangles and reports triangle tests per
+// second for each. The SIMD version is the scalar one again when the build
+// has no AVX.
+
+#include "scene/bvh_kernels.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace CGL;
+using namespace CGL::SceneObjects;
+
+static const size_t kNumBlocks = 4096;
+static const size_t kNumRays = 512;
+
+static float uniform(float lo, float hi) {
+  return lo + (hi - lo) * ((float)rand() / RAND_MAX);
+}
+
+typedef int (*BlockKernel)(const BVH4TriangleBlock &, const FloatRay &,
+                           float, float, float);
+
+static double run(BlockKernel kernel, const std::vector<BVH4TriangleBlock> &blocks,
+                  const std::vector<FloatRay> &rays, size_t *candidates) {
+  // Ray origins and triangle vertices lie within [-10, 10].
+  float tolerance = kTriangleTolerance * 10;
+  *candidates = 0;
+  std::chrono::high_resolution_clock::time_point start =
+      std::chrono::high_resolution_clock::now();
+  for (size_t r = 0; r < rays.size(); r++) {
+    for (size_t b = 0; b < blocks.size(); b++) {
+      int mask = kernel(blocks[b], rays[r], 0, INF_F, tolerance);
+      *candidates += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + (mask >> 3);
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::high_resolution_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+
+  srand(7);
+
+  std::vector<BVH4TriangleBlock> blocks(kNumBlocks);
+  for (size_t b = 0; b < kNumBlocks; b++) {
+    for (int k = 0; k < 4; k++) {
+      for (int a = 0; a < 3; a++) {
+        blocks[b].p0[a][k] = uniform(-10, 10);
+        blocks[b].e1[a][k] = uniform(-1, 1);
+        blocks[b].e2[a][k] = uniform(-1, 1);
+      }
+    }
+  }
+
+  std::vector<FloatRay> rays;
+  for (size_t r = 0; r < kNumRays; r++) {
+    Vector3D o(uniform(-10, 10), uniform(-10, 10), uniform(-10, 10));
+    Vector3D d(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+    rays.push_back(FloatRay(Ray(o, d.unit())));
+  }
+
+  double tests = 4.0 * kNumBlocks * kNumRays;
+  size_t scalar_candidates, simd_candidates;
+  double scalar_time = run(intersect_triangles_scalar, blocks, rays, &scalar_candidates);
+  double simd_time = run(intersect_triangles, blocks, rays, &simd_candidates);
+
+  printf("scalar: %.1f million triangle tests per second\n", tests / scalar_time * 1e-6);
+  printf("simd:   %.1f million triangle tests per second (%.2fx)\n",
+         tests / simd_time * 1e-6, scalar_time / simd_time);
+
+  if (scalar_candidates != simd_candidates) {
+    fprintf(stderr, "kernels disagree: %zu scalar vs %zu simd candidates\n",
+            scalar_candidates, simd_candidates);
+    return 1;
+  }
+  return 0;
+}